@@ -63,21 +63,26 @@ class HMCDiag:
 
     def leapfrog(
         self, theta: NDArray[np.float64], rho: NDArray[np.float64]
-    ) -> Tuple[NDArray[np.float64], NDArray[np.float64]]:
-        # TODO(bob-carpenter): refactor to share non-initial and non-final updates
+    ) -> Tuple[NDArray[np.float64], NDArray[np.float64], float]:
+        # run the whole trajectory in one request if the model supports it
+        if hasattr(self._model, "leapfrog"):
+            theta, rho, lp, _ = self._model.leapfrog(
+                theta, rho, self._stepsize, self._steps, self._metric
+            )
+            return (theta, rho, lp)
+        lp, grad = self._model.log_density_gradient(theta)
         for n in range(self._steps):
+            rho = rho + 0.5 * self._stepsize * grad
+            theta = theta + self._stepsize * np.multiply(self._metric, rho)
             lp, grad = self._model.log_density_gradient(theta)
-            rho_mid = rho + 0.5 * self._stepsize * np.multiply(self._metric, grad)
-            theta = theta + self._stepsize * rho_mid
-            lp, grad = self._model.log_density_gradient(theta)
-            rho = rho_mid + 0.5 * self._stepsize * np.multiply(self._metric, grad)
-        return (theta, rho)
+            rho = rho + 0.5 * self._stepsize * grad
+        return (theta, rho, lp)
 
     def sample(self) -> Tuple[NDArray[np.float64], float]:
-        rho = np.random.normal(size=self._dim)
+        rho = np.random.normal(size=self._dim) / np.sqrt(self._metric)
         logp = self.joint_logp(self._theta, rho)
-        theta_prop, rho_prop = self.leapfrog(self._theta, rho)
-        logp_prop = self.joint_logp(theta_prop, rho_prop)
+        theta_prop, rho_prop, lp_prop = self.leapfrog(self._theta, rho)
+        logp_prop = lp_prop - 0.5 * np.dot(rho_prop, np.multiply(self._metric, rho_prop))
         if np.log(np.random.uniform()) < logp_prop - logp:
             self._theta = theta_prop
             return self._theta, logp_prop
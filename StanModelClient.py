@@ -5,44 +5,194 @@ This module supplies a client for the Stan Model Server.
 import numpy as np
 import numpy.typing as npt
 import json
+import socket
+import struct
 import subprocess
-from typing import Any, Iterable, List, Mapping, Tuple, Union
+from multiprocessing import shared_memory
+from typing import (
+    Any, Iterable, Iterator, List, Mapping, Optional, Sequence, Tuple, Union
+)
+
+# binary protocol header: opcode, flags, reserved, payload length
+_HEADER = struct.Struct("<HHIQ")
+
+# binary protocol status of a part of a streamed response
+_PARTIAL = 3
+
+def _check_reply(reply: str) -> str:
+    """Return a text protocol reply, or raise if it reports an error.
+
+    Args:
+        reply: Line of text sent by the server
+    Return:
+        The reply
+    Raises:
+        RuntimeError: with the server's message if the reply is an error
+    """
+    status, sep, msg = reply.partition(": ")
+    if status in ("ERROR", "UNKNOWN") and (sep or not msg):
+        raise RuntimeError(msg or reply)
+    return reply
+
+
+# binary protocol instruction codes
+_OPCODES = {
+    "quit": 0,
+    "name": 1,
+    "param_names": 2,
+    "param_unc_names": 3,
+    "param_num": 4,
+    "param_unc_num": 5,
+    "param_constrain": 6,
+    "param_unconstrain": 7,
+    "log_density": 8,
+    "log_density_batch": 9,
+    "log_density_hvp": 10,
+    "shm_attach": 11,
+    "stats": 12,
+    "leapfrog": 13,
+    "sample": 14,
+    "param_constrain_batch": 15,
+    "use": 16,
+    "load_data": 17,
+    "append_data": 18,
+}
 
 
 class StanClient:
     """Stan client class holding all resources.
 
     Attributes:
-        server: Subprocess for Stan model server
+        server: Subprocess for Stan model server, or `None` if connected
+            to a server that is already listening
+        binary: `True` if using the binary protocol, `False` for text
+        shm: Shared-memory segment holding binary payloads, or `None`
+            if payloads are sent over the pipe or socket
     """
 
-    def __init__(self, modelExe: str, data: str, seed: int = 1234) -> None:
+    def __init__(
+        self,
+        modelExe: Optional[str] = None,
+        data: Optional[str] = None,
+        seed: int = 1234,
+        protocol: str = "text",
+        address: Optional[str] = None,
+        transport: str = "stream",
+        shm_size: int = 1 << 24,
+        threads: int = 1,
+        instances: Sequence[str] = (),
+    ) -> None:
         """Construct a Stan client with open subprocess to server.
 
+        If `address` is given, connect to a server already listening
+        on it (see the `--listen` option of the server) instead of
+        starting a subprocess; the server's data, seed, and protocol
+        then apply and `modelExe`, `data`, `seed`, and `threads` are
+        ignored.
+
+        With `transport="shm"`, the binary protocol is used and
+        request and response payloads are exchanged through a POSIX
+        shared-memory segment of `shm_size` bytes, half for requests
+        and half for responses, with only message headers sent over
+        the pipe or socket.  The server must run on the same host.
+
         Args:
             modelExe: Path to Stan model server executable
             data: Path to JSON data file
             seed: Pseudo-random number generator seed; Defaults to 1234
+            protocol: `"text"` or `"binary"`; Defaults to `"text"`
+            address: `"unix:<path>"`, `"tcp:<port>"`, or `"tcp:<host>:<port>"`
+            transport: `"stream"` or `"shm"`; Defaults to `"stream"`
+            shm_size: Size in bytes of shared-memory segment
+            threads: Number of server threads for batched instructions
+                and parallel chains; Defaults to 1
+            instances: Specifications of further model instances, such
+                as `"name=b,data=b.json,seed=5"`, selected with `use`
         """
-        cmd = [modelExe, "-d", data, "-s", str(seed)]
-        self.server: subprocess.Popen[bytes] = subprocess.Popen(
-            cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE
-        )
+        if protocol not in ("text", "binary"):
+            raise ValueError(f"unknown protocol: {protocol}")
+        if transport not in ("stream", "shm"):
+            raise ValueError(f"unknown transport: {transport}")
+        if transport == "shm":
+            protocol = "binary"
+        self.binary = protocol == "binary"
+        self.shm: Optional[shared_memory.SharedMemory] = None
+        self.server: Optional[subprocess.Popen[bytes]] = None
+        if address is not None:
+            self._sock = self._connect(address)
+            self._in = self._sock.makefile("rb")
+            self._out = self._sock.makefile("wb")
+        else:
+            if modelExe is None:
+                raise ValueError("either modelExe or address is required")
+            cmd = [modelExe, "-s", str(seed), "--protocol", protocol]
+            if data is not None:
+                cmd += ["-d", data]
+            if threads > 1:
+                cmd += ["-t", str(threads)]
+            for instance in instances:
+                cmd += ["-i", instance]
+            self.server = subprocess.Popen(
+                cmd,
+                stdin=subprocess.PIPE,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+            )
+            self._in = self.server.stdout
+            self._out = self.server.stdin
+        if transport == "shm":
+            self._attach_shm(shm_size)
 
     def __del__(self) -> None:
-        """Close the server process, terminate it, and wait for shutdown."""
-        self._request("quit")
-        self.server.stdin.close()  # type:ignore
+        """Close the server process, terminate it, and wait for shutdown.
+
+        When connected to a listening server, only this client's
+        session is closed.
+        """
+        if self.binary:
+            self._binary_request("quit")
+        else:
+            self._request("quit")
+        if self.shm is not None:
+            self.shm.close()
+        self._out.close()  # type:ignore
+        if self.server is None:
+            self._in.close()  # type:ignore
+            self._sock.close()
+            return
         # TODO(carpenter): check to see if quit already closes
         self.server.terminate()
         self.server.wait(timeout=0.5)
 
+    @staticmethod
+    def _connect(address: str) -> socket.socket:
+        if address.startswith("unix:"):
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(address[5:])
+            return sock
+        if address.startswith("tcp:"):
+            host, _, port = address[4:].rpartition(":")
+            sock = socket.create_connection((host or "localhost", int(port)))
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            return sock
+        raise ValueError(f"unknown address: {address}")
+
+    def _attach_shm(self, size: int) -> None:
+        shm = shared_memory.SharedMemory(create=True, size=size)
+        try:
+            body = self._binary_request("shm_attach", payload=b"/" + shm.name.encode())
+        finally:
+            # the server holds its own mapping, so the name is no longer needed
+            shm.unlink()
+        self._shm_capacity = int(np.frombuffer(body, "<i8")[0])
+        self.shm = shm
+
     # I/O functions
     def _read(self) -> str:
-        return self.server.stdout.readline().decode("utf-8").strip()  # type:ignore
+        return self._in.readline().decode("utf-8").strip()  # type:ignore
 
     def _write(self, msg: str) -> None:
-        self.server.stdin.write(msg.encode("utf-8"))  # type:ignore
+        self._out.write(msg.encode("utf-8"))  # type:ignore
 
     def _write_num(self, x: float) -> None:
         self._write(" ")
@@ -54,8 +204,8 @@ class StanClient:
 
     def _get_return(self) -> str:
         self._write("\n")
-        self.server.stdin.flush()  # type:ignore
-        return self._read()
+        self._out.flush()  # type:ignore
+        return _check_reply(self._read())
 
     def _get_return_float(self) -> float:
         return float(self._get_return())
@@ -69,6 +219,60 @@ class StanClient:
         self._write(msg)
         return self._get_return()
 
+    def _read_bytes(self, n: int) -> bytes:
+        buf = self._in.read(n)  # type:ignore
+        if len(buf) != n:
+            raise RuntimeError("server closed connection")
+        return buf  # type:ignore
+
+    def _binary_send(
+        self, instruction: str, flags: Iterable[bool] = (), payload: bytes = b""
+    ) -> None:
+        bits = 0
+        for i, flag in enumerate(flags):
+            bits |= int(bool(flag)) << i
+        header = _HEADER.pack(_OPCODES[instruction], bits, 0, len(payload))
+        if self.shm is not None:
+            if len(payload) > self._shm_capacity:
+                raise ValueError("request exceeds shared memory capacity")
+            self.shm.buf[: len(payload)] = payload
+            self._out.write(header)  # type:ignore
+        else:
+            self._out.write(header)  # type:ignore
+            self._out.write(payload)  # type:ignore
+        self._out.flush()  # type:ignore
+
+    def _binary_receive(self) -> Tuple[int, bytes]:
+        _, status, _, length = _HEADER.unpack(self._read_bytes(_HEADER.size))
+        # partial responses always carry their payload on the stream
+        if self.shm is not None and status != _PARTIAL:
+            start = self._shm_capacity
+            return status, bytes(self.shm.buf[start : start + length])
+        return status, self._read_bytes(length)
+
+    def _binary_request(
+        self, instruction: str, flags: Iterable[bool] = (), payload: bytes = b""
+    ) -> bytes:
+        self._binary_send(instruction, flags, payload)
+        status, body = self._binary_receive()
+        if status != 0:
+            raise RuntimeError(body.decode("utf-8"))
+        return body
+
+    def _binary_request_int(
+        self, instruction: str, flags: Iterable[bool] = ()
+    ) -> int:
+        return int(np.frombuffer(self._binary_request(instruction, flags), "<i8")[0])
+
+    def _binary_request_floats(
+        self, instruction: str, flags: Iterable[bool] = (), payload: bytes = b""
+    ) -> npt.NDArray[np.float64]:
+        return np.frombuffer(self._binary_request(instruction, flags, payload), "<f8")
+
+    @staticmethod
+    def _pack(xs: Iterable[float]) -> bytes:
+        return np.asarray(xs, dtype="<f8").tobytes()
+
     # REPL functions
     def name(self) -> str:
         """Return name of model being served.
@@ -76,8 +280,66 @@ class StanClient:
         Return:
             Name of model being served.
         """
+        if self.binary:
+            return self._binary_request("name").decode("utf-8")
         return self._request("name")
 
+    def use(self, instance: str) -> int:
+        """Direct subsequent requests to the named model instance.
+
+        The server starts with its default instance, named `"default"`,
+        or its first instance.
+
+        Args:
+            instance: Name of model instance
+        Return:
+            number of unconstrained parameters of the instance's model
+        """
+        if self.binary:
+            body = self._binary_request("use", (), instance.encode("utf-8"))
+            return int(np.frombuffer(body, "<i8")[0])
+        return int(self._request(f"use {instance}"))
+
+    def load_data(self, data: Union[str, Mapping[str, Any]]) -> int:
+        """Replace the current model instance with one created from new data.
+
+        Other sessions keep using the current instance until the new
+        one is complete and then use the new one from their next request.
+
+        Args:
+            data: Path of data file on the server's host, or mapping
+                from variable names to values sent as JSON
+        Return:
+            number of unconstrained parameters of the new model
+        """
+        if not isinstance(data, str):
+            data = json.dumps(data)
+        if self.binary:
+            body = self._binary_request("load_data", (), data.encode("utf-8"))
+            return int(np.frombuffer(body, "<i8")[0])
+        return int(self._request(f"load_data {data}"))
+
+    def append_data(self, rows: Mapping[str, Any]) -> int:
+        """Replace the current model instance with one whose data is
+        extended by the specified rows.
+
+        Arrays are extended along their first dimension and scalars,
+        such as sizes, are replaced.  Only the rows are sent and parsed.
+
+        Args:
+            rows: Mapping from variable names to rows to append or
+                scalar values to replace
+        Return:
+            number of unconstrained parameters of the new model
+        """
+        payload = json.dumps(rows)
+        if self.binary:
+            body = self._binary_request(
+                "append_data", (), payload.encode("utf-8")
+            )
+            return int(np.frombuffer(body, "<i8")[0])
+        return int(self._request(f"append_data {payload}"))
+
     def param_num(self, tp: bool = True, gq: bool = True) -> int:
         """Return the number of constrained parameters.
 
@@ -90,6 +352,8 @@ class StanClient:
         Return:
             number of parameters
         """
+        if self.binary:
+            return self._binary_request_int("param_num", (tp, gq))
         return int(self._request(f"param_num {int(tp)} {int(gq)}"))
 
     def dims(self) -> int:
@@ -113,6 +377,8 @@ class StanClient:
         Return:
             number of unconstrained parameters
         """
+        if self.binary:
+            return self._binary_request_int("param_unc_num")
         return int(self._request("param_unc_num"))
 
     def param_names(self, tp: bool = True, gq: bool = True) -> List[str]:
@@ -131,7 +397,10 @@ class StanClient:
         Return:
             array of parameter names
         """
-        return self._request(f"param_names + {int(tp)} {int(tp)}").split(",")
+        if self.binary:
+            names = self._binary_request("param_names", (tp, gq)).decode("utf-8")
+            return names.split(",")
+        return self._request(f"param_names {int(tp)} {int(gq)}").split(",")
 
     def param_unc_names(self) -> List[str]:
         """Return the encoded unconstrained parameter names.
@@ -146,27 +415,83 @@ class StanClient:
         Return:
             array of parameter names
         """
+        if self.binary:
+            return self._binary_request("param_unc_names").decode("utf-8").split(",")
         return self._request("param_unc_names").split(",")
 
     def param_constrain(
-        self, params_unc: Iterable[float], tp: bool = True, gq: bool = True
+        self,
+        params_unc: Iterable[float],
+        tp: bool = True,
+        gq: bool = True,
+        draw: Optional[int] = None,
     ) -> npt.NDArray[np.float64]:
         """Return the constrained parameters for the specified unconstrained parameters.
 
         Optionally include the transformed parameters and generate the
         generated quantities using the pseudo-RNG built into the server.
+        If `draw` is given, the generated quantities use the server's
+        pseudo-RNG stream for that draw, so they are reproducible
+        regardless of earlier requests.
 
         Args:
             params_unc: unconstrained parameters
             tp: `True` to include transformed parameters, `False` to exclude
             gq: `True` to include generated quantitites, `False` to exclude
+            draw: identifier of draw between 0 and 2^39 - 1, or `None`
         Return:
             array of constrained parameters in double precision
         """
+        if self.binary:
+            payload = self._pack(params_unc)
+            if draw is not None:
+                payload += struct.pack("<q", draw)
+            return self._binary_request_floats("param_constrain", (tp, gq), payload)
         self._write(f"param_constrain {int(tp)} {int(gq)}")
         self._write_nums(params_unc)
+        if draw is not None:
+            self._write_num(int(draw))
         return self._get_return_floats()
 
+    def param_constrain_batch(
+        self,
+        params_unc: npt.ArrayLike,
+        tp: bool = True,
+        gq: bool = True,
+        first_draw: Optional[int] = None,
+    ) -> npt.NDArray[np.float64]:
+        """Return the constrained parameters for a batch of unconstrained parameters.
+
+        All points are constrained with a single request.  If
+        `first_draw` is given, the generated quantities of the point in
+        row `n` use the server's pseudo-RNG stream for draw
+        `first_draw + n`, and the server may constrain points in
+        parallel; otherwise they use the pseudo-RNG built into the
+        server in order.
+
+        Args:
+            params_unc: unconstrained parameter values, one point per row
+            tp: `True` to include transformed parameters, `False` to exclude
+            gq: `True` to include generated quantitites, `False` to exclude
+            first_draw: identifier of draw for the first point, or `None`
+        Return:
+            array of constrained parameters, one row per point
+        """
+        xs = np.atleast_2d(np.asarray(params_unc, dtype=np.float64))
+        N = xs.shape[0]
+        if self.binary:
+            payload = struct.pack("<q", N) + self._pack(xs.ravel())
+            if first_draw is not None:
+                payload += struct.pack("<q", first_draw)
+            zs = self._binary_request_floats("param_constrain_batch", (tp, gq), payload)
+        else:
+            self._write(f"param_constrain_batch {int(tp)} {int(gq)} {N}")
+            self._write_nums(xs.ravel())
+            if first_draw is not None:
+                self._write_num(int(first_draw))
+            zs = self._get_return_floats()
+        return np.reshape(zs, (N, -1))
+
     def param_unconstrain(
         self, param_dict: Mapping[str, Union[float, npt.ArrayLike]]
     ) -> npt.NDArray[np.float64]:
@@ -182,6 +507,10 @@ class StanClient:
         Return:
             array of constrained parameters in double precision
         """
+        if self.binary:
+            return self._binary_request_floats(
+                "param_unconstrain", (), json.dumps(param_dict).encode("utf-8")
+            )
         self._write("param_unconstrain ")
         self._write(json.dumps(param_dict))
         return self._get_return_floats()
@@ -202,6 +531,12 @@ class StanClient:
         Return:
             log density of unconstrained parameters
         """
+        if self.binary:
+            return float(
+                self._binary_request_floats(
+                    "log_density", (propto, jacobian, False, False), self._pack(params_unc)
+                )[0]
+            )
         self._write(f"log_density {int(propto)} {int(jacobian)} 0 0")
         self._write_nums(params_unc)
         return self._get_return_float()
@@ -222,29 +557,229 @@ class StanClient:
         Return:
             pair of log density and gradient of unconstrained parameters
         """
+        if self.binary:
+            zs = self._binary_request_floats(
+                "log_density", (propto, jacobian, True, False), self._pack(params_unc)
+            )
+            return zs[0], zs[1:]
         self._write(f"log_density {int(propto)} {int(jacobian)} 1 0")
         self._write_nums(params_unc)
         zs = self._get_return_floats()
         return zs[0], zs[1:]
 
     def log_density_hessian(
-        self, params_unc: Iterable[float], propto: bool = True, jacobian: bool = False
+        self,
+        params_unc: Iterable[float],
+        propto: bool = True,
+        jacobian: bool = False,
+        hess_method: str = "fd",
     ) -> Tuple[float, npt.NDArray[np.float64], npt.NDArray[np.float64]]:
         """Return a triple of log density, gradient, and Hessian for unconstrained parameters.
 
         The `propto` and `jacobian` flags indicate whether to include
         the constant terms and the change-of-variables adjustment in the
-        result.
+        result.  The Hessian is computed with finite differences of
+        gradients if `hess_method` is `"fd"` and with nested autodiff
+        if it is `"ad"`, which requires a server built with
+        `HESSIAN_AD=true`.
 
         Args:
             params_unc: unconstrained parameter values
             propto: `True` to exclude constant terms, `False` to include
             jacobian: `True` to include change-of-variables adjustment, `False` to exclude
+            hess_method: `"fd"` for finite differences, `"ad"` for autodiff
         Return:
             tuple of log density, gradient, and Hessian of unconstrained parameters
         """
-        self._write(f"log_density {int(propto)} {int(propto)} 1 1")
-        self._write_nums(params_unc)
-        zs = self._get_return_floats()
+        hess = {"fd": 1, "ad": 2}[hess_method]
+        if self.binary:
+            flags = (propto, jacobian, True, hess & 1, hess & 2)
+            zs = self._binary_request_floats(
+                "log_density", flags, self._pack(params_unc)
+            )
+        else:
+            self._write(f"log_density {int(propto)} {int(jacobian)} 1 {hess}")
+            self._write_nums(params_unc)
+            zs = self._get_return_floats()
         N = int(np.sqrt(len(zs) - 1))
         return zs[0], zs[1 : (N + 1)], np.reshape(zs[(N + 1) :], (N, N))
+
+    def log_density_hvp(
+        self,
+        params_unc: Iterable[float],
+        v: Iterable[float],
+        propto: bool = True,
+        jacobian: bool = True,
+    ) -> Tuple[float, npt.NDArray[np.float64], npt.NDArray[np.float64]]:
+        """Return a triple of log density, gradient, and Hessian-vector product.
+
+        The product of the Hessian of the log density at `params_unc`
+        and the vector `v` is computed without forming the Hessian.
+        The `propto` and `jacobian` flags indicate whether to include
+        the constant terms and the change-of-variables adjustment in the
+        result.
+
+        Args:
+            params_unc: unconstrained parameter values
+            v: vector to multiply by the Hessian
+            propto: `True` to exclude constant terms, `False` to include
+            jacobian: `True` to include change-of-variables adjustment, `False` to exclude
+        Return:
+            tuple of log density, gradient, and Hessian times `v`
+        """
+        if self.binary:
+            payload = self._pack(params_unc) + self._pack(v)
+            zs = self._binary_request_floats(
+                "log_density_hvp", (propto, jacobian), payload
+            )
+        else:
+            self._write(f"log_density_hvp {int(propto)} {int(jacobian)}")
+            self._write_nums(params_unc)
+            self._write_nums(v)
+            zs = self._get_return_floats()
+        N = (len(zs) - 1) // 2
+        return zs[0], zs[1 : (N + 1)], zs[(N + 1) :]
+
+    def log_density_batch(
+        self, params_unc: npt.ArrayLike, propto: bool = True, jacobian: bool = True
+    ) -> Tuple[npt.NDArray[np.float64], npt.NDArray[np.float64]]:
+        """Return log densities and gradients for a batch of unconstrained parameters.
+
+        All points are evaluated with a single request.  The `propto`
+        and `jacobian` flags indicate whether to include the constant
+        terms and the change-of-variables adjustment in the result.
+
+        Args:
+            params_unc: unconstrained parameter values, one point per row
+            propto: `True` to exclude constant terms, `False` to include
+            jacobian: `True` to include change-of-variables adjustment, `False` to exclude
+        Return:
+            pair of log densities (one per point) and gradients (one row per point)
+        """
+        xs = np.atleast_2d(np.asarray(params_unc, dtype=np.float64))
+        N = xs.shape[0]
+        if self.binary:
+            payload = struct.pack("<q", N) + self._pack(xs.ravel())
+            zs = self._binary_request_floats(
+                "log_density_batch", (propto, jacobian), payload
+            )
+        else:
+            self._write(f"log_density_batch {int(propto)} {int(jacobian)} {N}")
+            self._write_nums(xs.ravel())
+            zs = self._get_return_floats()
+        return zs[:N], np.reshape(zs[N:], (N, -1))
+
+    def leapfrog(
+        self,
+        theta: Iterable[float],
+        rho: Iterable[float],
+        stepsize: float,
+        steps: int,
+        metric_diag: Optional[Iterable[float]] = None,
+        propto: bool = True,
+        jacobian: bool = True,
+    ) -> Tuple[
+        npt.NDArray[np.float64], npt.NDArray[np.float64], float, npt.NDArray[np.float64]
+    ]:
+        """Return the result of leapfrog steps of Hamiltonian dynamics.
+
+        The whole trajectory is computed by the server in a single
+        request.  The `propto` and `jacobian` flags indicate whether to
+        include the constant terms and the change-of-variables
+        adjustment in the log density.
+
+        Args:
+            theta: initial unconstrained parameter values
+            rho: initial momenta
+            stepsize: step size
+            steps: number of leapfrog steps
+            metric_diag: diagonal of inverse metric; Defaults to ones
+            propto: `True` to exclude constant terms, `False` to include
+            jacobian: `True` to include change-of-variables adjustment, `False` to exclude
+        Return:
+            final parameters, final momenta, and log density and gradient at final parameters
+        """
+        theta = np.asarray(theta, dtype=np.float64)
+        rho = np.asarray(rho, dtype=np.float64)
+        D = len(theta)
+        metric = np.ones(D) if metric_diag is None else np.asarray(metric_diag)
+        if self.binary:
+            payload = (
+                struct.pack("<qd", steps, stepsize)
+                + self._pack(theta)
+                + self._pack(rho)
+                + self._pack(metric)
+            )
+            zs = self._binary_request_floats("leapfrog", (propto, jacobian), payload)
+        else:
+            self._write(f"leapfrog {int(propto)} {int(jacobian)} {int(steps)}")
+            self._write_num(stepsize)
+            self._write_nums(theta)
+            self._write_nums(rho)
+            self._write_nums(metric)
+            zs = self._get_return_floats()
+        return zs[:D], zs[D : 2 * D], zs[2 * D], zs[(2 * D + 1) :]
+
+    def sample(
+        self,
+        num_warmup: int = 1000,
+        num_samples: int = 1000,
+        seed: int = 1234,
+        chains: int = 1,
+    ) -> Tuple[List[str], Iterator[npt.NDArray[np.float64]]]:
+        """Run Stan's NUTS sampler in the server and stream its draws.
+
+        The column names are read before returning.  Draws are read
+        from the server as the returned iterator is advanced, so they
+        may be consumed while sampling continues; the iterator must be
+        exhausted before making another request.
+
+        Args:
+            num_warmup: number of warmup iterations per chain
+            num_samples: number of draws per chain
+            seed: pseudo-random number generator seed
+            chains: number of chains
+        Return:
+            pair of column names, starting with `chain__`, and an iterator over draws
+        """
+        if self.binary:
+            payload = struct.pack("<qqqq", num_warmup, num_samples, seed, chains)
+            self._binary_send("sample", (), payload)
+            status, body = self._binary_receive()
+            if status != _PARTIAL:
+                raise RuntimeError(body.decode("utf-8"))
+            names = body.decode("utf-8").split(",")
+        else:
+            header = self._request(f"sample {num_warmup} {num_samples} {seed} {chains}")
+            if "," not in header:
+                raise RuntimeError(f"sample failed: {header}")
+            names = header.split(",")
+        return names, self._draws()
+
+    def _draws(self) -> Iterator[npt.NDArray[np.float64]]:
+        while True:
+            if self.binary:
+                status, body = self._binary_receive()
+                if status == 0:
+                    return
+                if status != _PARTIAL:
+                    raise RuntimeError(body.decode("utf-8"))
+                yield np.frombuffer(body, "<f8")
+            else:
+                # the final line holds the number of draws or an error
+                line = _check_reply(self._read())
+                if "," not in line:
+                    return
+                yield np.fromstring(line, sep=",", dtype=np.float64)  # type:ignore
+
+    def stats(self) -> Mapping[str, str]:
+        """Return statistics collected by the server.
+
+        Return:
+            Mapping from name of statistic to its value as reported by the server.
+        """
+        if self.binary:
+            entries = self._binary_request("stats").decode("utf-8")
+        else:
+            entries = self._request("stats")
+        return dict(entry.split("=", 1) for entry in entries.split(",") if entry)
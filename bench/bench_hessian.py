@@ -0,0 +1,38 @@
+# Benchmark autodiff versus finite-difference Hessians.
+#
+# First build stan/multi/multi with autodiff Hessians
+# > cd <stan-model-server>
+# make -j4 HESSIAN_AD=true stan/multi/multi
+#
+# Then run from the top-level directory with the number of parameters
+# as an optional argument
+# > python3 bench/bench_hessian.py 200
+
+import os
+import sys
+import time
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), os.pardir))
+import StanModelClient as smc
+
+server = "stan/multi/multi"
+data = "stan/multi/multi.data.json"
+D = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+reps = 10
+
+model = smc.StanClient(server, data=data, seed=1234, protocol="binary")
+model.load_data({"M": D, "N": 3, "P": 10})
+theta = np.random.normal(size=D)
+
+hessians = {}
+for method in ["fd", "ad"]:
+    start = time.perf_counter()
+    for _ in range(reps):
+        _, _, hessians[method] = model.log_density_hessian(theta, hess_method=method)
+    elapsed = (time.perf_counter() - start) / reps
+    print(f"{method}: {elapsed * 1000:10.3f} ms per Hessian (D = {D})")
+
+print(f"max |ad - fd|: {np.max(np.abs(hessians['ad'] - hessians['fd'])):.3e}")
+print(f"max |ad + I|:  {np.max(np.abs(hessians['ad'] + np.eye(D))):.3e}")
@@ -17,7 +17,7 @@ steps = 10
 metric_diag = [1] * D
 sampler = mcmc.HMCDiag(model, stepsize=stepsize, steps=steps, metric_diag=metric_diag)
 
-# works, but excruciatingly slow
+# each trajectory is computed by the server in a single request
 M = 1000
 theta = np.empty([M, D])
 for m in range(M):
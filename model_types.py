@@ -18,6 +18,18 @@ class GradModel(LogDensityModel, Protocol):
         ...
 
 
+class LeapfrogModel(GradModel, Protocol):
+    def leapfrog(
+        self,
+        theta: ArrayLike,
+        rho: ArrayLike,
+        stepsize: float,
+        steps: int,
+        metric_diag: ArrayLike,
+    ) -> Tuple[NDArray[np.float64], NDArray[np.float64], float, NDArray[np.float64]]:
+        ...
+
+
 class HessianModel(GradModel, Protocol):
     def log_density_hessian(
         self, params_unc: ArrayLike
@@ -0,0 +1,262 @@
+// Drives the server's REPL directly, so it includes the server itself
+// without its `main`.
+#define STAN_MODEL_SERVER_NO_MAIN
+#include "main.cpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+/**
+ * Number of heap allocations made by the calling thread.  Counting
+ * per thread means that allocations by other threads, such as those of
+ * the TBB scheduler, are not attributed to the requests evaluated on
+ * the thread under test.
+ */
+thread_local std::uint64_t num_allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t num, std::size_t size);
+void* __libc_realloc(void* p, std::size_t size);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+void* __libc_valloc(std::size_t size);
+void* __libc_pvalloc(std::size_t size);
+
+// With the GNU C library, the `malloc` family is replaced so that the
+// memory Eigen allocates with `malloc` is counted along with
+// `operator new`, which libstdc++ implements with `malloc`.  Memory
+// from any of these functions is freed by glibc's own `free`.
+
+void* malloc(std::size_t size) {
+  ++num_allocations;
+  return __libc_malloc(size);
+}
+
+void* calloc(std::size_t num, std::size_t size) {
+  ++num_allocations;
+  return __libc_calloc(num, size);
+}
+
+void* realloc(void* p, std::size_t size) {
+  if (p == nullptr)
+    ++num_allocations;
+  return __libc_realloc(p, size);
+}
+
+void* reallocarray(void* p, std::size_t num, std::size_t size) {
+  if (size != 0 && num > static_cast<std::size_t>(-1) / size) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return realloc(p, num * size);
+}
+
+void* memalign(std::size_t alignment, std::size_t size) {
+  ++num_allocations;
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size) {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void** p, std::size_t alignment, std::size_t size) {
+  if (alignment == 0 || alignment % sizeof(void*) != 0
+      || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  void* q = memalign(alignment, size);
+  if (q == nullptr)
+    return ENOMEM;
+  *p = q;
+  return 0;
+}
+
+void* valloc(std::size_t size) {
+  ++num_allocations;
+  return __libc_valloc(size);
+}
+
+void* pvalloc(std::size_t size) {
+  ++num_allocations;
+  return __libc_pvalloc(size);
+}
+}  // extern "C"
+#else
+// Elsewhere only `operator new` is counted; the other forms call this
+// one.
+
+void* operator new(std::size_t size) {
+  ++num_allocations;
+  while (true) {
+    if (void* p = std::malloc(size == 0 ? 1 : size))
+      return p;
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr)
+      throw std::bad_alloc();
+    handler();
+  }
+}
+
+void* operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+#endif
+
+/**
+ * Stream buffer that discards its output and counts the characters
+ * written to it, without allocating.
+ */
+struct counting_streambuf : public std::streambuf {
+  /** Number of characters written */
+  std::size_t count_ = 0;
+
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+      ++count_;
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char*, std::streamsize n) override {
+    count_ += n;
+    return n;
+  }
+};
+
+/**
+ * Append a binary request with the specified instruction, flags and
+ * floating-point arguments to the specified string.
+ *
+ * @param[in] code instruction
+ * @param[in] flags boolean arguments
+ * @param[in] x floating-point arguments
+ * @param[in,out] requests string to which to append request
+ */
+void append_binary_request(instruction code, std::uint16_t flags,
+                           const Eigen::VectorXd& x, std::string& requests) {
+  binary_header header{static_cast<std::uint16_t>(code), flags, 0,
+                       x.size() * sizeof(double)};
+  requests.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  requests.append(reinterpret_cast<const char*>(x.data()),
+                  x.size() * sizeof(double));
+}
+
+/**
+ * Append a text `log_density` request with the specified flags and
+ * unconstrained parameters to the specified string.
+ *
+ * @param[in] propto `true` to drop constant terms
+ * @param[in] jacobian `true` to include change-of-variables terms
+ * @param[in] grad `true` to return the gradient
+ * @param[in] x unconstrained parameters
+ * @param[in,out] requests string to which to append request
+ */
+void append_text_request(bool propto, bool jacobian, bool grad,
+                         const Eigen::VectorXd& x, std::string& requests) {
+  std::stringstream line;
+  line.precision(17);
+  line << "log_density " << propto << " " << jacobian << " " << grad
+       << " 0 ";
+  for (int i = 0; i < x.size(); ++i)
+    line << (i == 0 ? "" : ",") << x(i);
+  requests += line.str();
+  requests += "\n";
+}
+
+/**
+ * Evaluate the specified requests with a REPL session for the default
+ * model instance, the first time to warm up its buffers and autodiff
+ * arena and the second time counting heap allocations.  Return the
+ * number of allocations made the second time.
+ *
+ * @param[in] models model instances
+ * @param[in] binary `true` if requests use the binary protocol
+ * @param[in] requests requests to evaluate, each evaluated twice
+ * @param[in] num_requests number of requests
+ * @return number of heap allocations made by the second evaluations
+ * @throw std::runtime_error if a request fails
+ */
+std::uint64_t count_allocations(model_registry& models, bool binary,
+                                const std::string& requests,
+                                int num_requests) {
+  std::istringstream in(requests + requests);
+  counting_streambuf out_buf;
+  counting_streambuf err_buf;
+  std::ostream out(&out_buf);
+  std::ostream err(&err_buf);
+  repl r(models, in, out, err, binary);
+  for (int n = 0; n < num_requests; ++n)
+    r.read_eval_print();
+  std::uint64_t before = num_allocations;
+  for (int n = 0; n < num_requests; ++n)
+    r.read_eval_print();
+  std::uint64_t allocations = num_allocations - before;
+  if (err_buf.count_ > 0)
+    throw std::runtime_error("a log_density request failed");
+  return allocations;
+}
+
+/**
+ * Test that once a session has evaluated a log density and its
+ * gradient, further `log_density` requests with or without the
+ * gradient make no heap allocations on the thread evaluating them,
+ * with both protocols and every combination of dropping constants and
+ * including the change-of-variables adjustment.  Allocations that the
+ * model itself makes are counted too, so a model that allocates in
+ * `log_prob` fails the test.
+ *
+ * Usage: `<model>_alloc_test [<server options>]`, where the options
+ * are those of the server, such as `--data` for the data file.
+ *
+ * @param[in] argc number of command-line arguments (including executable)
+ * @param[in] argv command-line arguments in C string format
+ * @return 0 if no request allocates, 1 if some do and 2 on error
+ */
+int main(int argc, const char* argv[]) {
+  try {
+    config cfg(argc, argv);
+    std::size_t num_params = cfg.models_.get(0)->param_unc_names_.size();
+    Eigen::VectorXd x(num_params);
+    for (std::size_t i = 0; i < num_params; ++i)
+      x(i) = 0.1 * (i + 1) * (i % 2 ? -1 : 1);
+
+    int num_failed = 0;
+    for (bool binary : {false, true}) {
+      std::string requests;
+      int num_requests = 0;
+      for (int flags = 0; flags < 8; ++flags) {
+        bool propto = flags & 1, jacobian = flags & 2, grad = flags & 4;
+        for (int n = 0; n < 10; ++n, ++num_requests) {
+          if (binary)
+            append_binary_request(instruction::LOG_DENSITY, flags, x,
+                                  requests);
+          else
+            append_text_request(propto, jacobian, grad, x, requests);
+        }
+      }
+      std::uint64_t allocations = count_allocations(cfg.models_, binary,
+                                                    requests, num_requests);
+      std::printf("%s protocol: %llu allocations in %d requests\n",
+                  binary ? "binary" : "text",
+                  static_cast<unsigned long long>(allocations),
+                  num_requests);
+      if (allocations > 0)
+        ++num_failed;
+    }
+    return num_failed == 0 ? 0 : 1;
+  } catch (const std::exception& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 2;
+  }
+}
@@ -3,13 +3,20 @@
 
 #include <cmdstan/io/json/json_data_handler.hpp>
 #include <cmdstan/io/json/json_error.hpp>
+#include <cmdstan/io/json/json_fast_parser.hpp>
 #include <cmdstan/io/json/rapidjson_parser.hpp>
 #include <stan/io/var_context.hpp>
+#ifdef STAN_THREADS
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#endif
 #include <iostream>
 #include <limits>
-#include <map>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_set>
 #include <vector>
 #include <complex>
 
@@ -37,17 +44,46 @@ namespace json {
  *
  * <p><code>json_data</code> objects are created by using the
  * <code>json_parser</code> and a <code>json_data_handler</code>
- * to read a single JSON text from an input stream.
+ * to read a single JSON text from an input stream or a range of
+ * characters.  When compiled with <code>STAN_THREADS</code>, the
+ * variables of a text given as characters are parsed in parallel, one
+ * task per variable.
+ *
+ * <p>The values and dimensions of each variable are held through a
+ * shared pointer and never changed, so copies of a
+ * <code>json_data</code> object, including those with rows appended,
+ * share the variables they do not change.
  */
 class json_data : public stan::io::var_context {
  private:
-  vars_map_r vars_r_;
-  vars_map_i vars_i_;
+  /** Values and dimensions of a real variable */
+  typedef vars_map_r::mapped_type var_r;
+
+  /** Values and dimensions of an integer variable */
+  typedef vars_map_i::mapped_type var_i;
+
+  std::unordered_map<std::string, std::shared_ptr<const var_r>> vars_r_;
+  std::unordered_map<std::string, std::shared_ptr<const var_i>> vars_i_;
 
   std::vector<double> const empty_vec_r_;
   std::vector<int> const empty_vec_i_;
   std::vector<size_t> const empty_vec_ui_;
 
+  /**
+   * Move the specified parsed variables into this object.
+   *
+   * @param vars_r Real variables.
+   * @param vars_i Integer variables.
+   */
+  void share(vars_map_r &vars_r, vars_map_i &vars_i) {
+    for (auto &var : vars_r)
+      vars_r_.emplace(var.first,
+                      std::make_shared<var_r>(std::move(var.second)));
+    for (auto &var : vars_i)
+      vars_i_.emplace(var.first,
+                      std::make_shared<var_i>(std::move(var.second)));
+  }
+
   /**
    * Return <code>true</code> if this json_data contains the specified
    * variable name defined as a real-valued variable. This method
@@ -61,9 +97,180 @@ class json_data : public stan::io::var_context {
     return vars_r_.find(name) != vars_r_.end();
   }
 
+  /**
+   * Return the values and dimensions of the specified variable
+   * extended by the specified rows along its first dimension.  The
+   * rows replace the values of a scalar or of an array without
+   * elements, and rows without elements leave the variable unchanged.
+   * Arrays are stored in column-major order, so the rows are
+   * interleaved with the values of each column.
+   *
+   * Returns the variable or the rows themselves, without copying, if
+   * either is unchanged.
+   *
+   * @tparam T type of values
+   * @param name Name of variable, for error messages.
+   * @param var Values and dimensions of variable.
+   * @param rows Values and dimensions of rows to append.
+   * @return Values and dimensions of extended variable.
+   * @throws std::runtime_error if the dimensions of the rows do not
+   * match those of the variable after the first
+   */
+  template <typename T>
+  static std::shared_ptr<const std::pair<std::vector<T>, std::vector<size_t>>>
+  append_rows(
+      const std::string &name,
+      const std::shared_ptr<const std::pair<std::vector<T>,
+                                            std::vector<size_t>>> &var,
+      const std::shared_ptr<const std::pair<std::vector<T>,
+                                            std::vector<size_t>>> &rows) {
+    const std::vector<size_t> &dims = var->second;
+    const std::vector<size_t> &row_dims = rows->second;
+    if (dims.empty() != row_dims.empty()) {
+      std::stringstream msg;
+      msg << "cannot append "
+          << (dims.empty() ? "array to scalar" : "scalar to array")
+          << "; variable name=" << name;
+      throw std::runtime_error(msg.str());
+    }
+    if (var->first.empty() || row_dims.empty())
+      return rows;
+    if (rows->first.empty())
+      return var;
+    bool match = dims.size() == row_dims.size();
+    for (size_t i = 1; match && i < dims.size(); ++i)
+      match = dims[i] == row_dims[i];
+    if (!match) {
+      std::stringstream msg;
+      msg << "mismatch in dimensions after the first of variable and "
+             "appended rows; variable name="
+          << name << "; dims found=";
+      dims_msg(msg, dims);
+      msg << "; dims appended=";
+      dims_msg(msg, row_dims);
+      throw std::runtime_error(msg.str());
+    }
+    size_t num_rows = dims[0];
+    size_t num_new_rows = row_dims[0];
+    size_t num_cols = var->first.size() / num_rows;
+    auto result
+        = std::make_shared<std::pair<std::vector<T>, std::vector<size_t>>>();
+    result->first.reserve(var->first.size() + rows->first.size());
+    for (size_t j = 0; j < num_cols; ++j) {
+      result->first.insert(result->first.end(),
+                           var->first.begin() + j * num_rows,
+                           var->first.begin() + (j + 1) * num_rows);
+      result->first.insert(result->first.end(),
+                           rows->first.begin() + j * num_new_rows,
+                           rows->first.begin() + (j + 1) * num_new_rows);
+    }
+    result->second = dims;
+    result->second[0] += num_new_rows;
+    return result;
+  }
+
+  /**
+   * Extend the variables of this object by the rows of the variables
+   * of the same names in the specified object, along their first
+   * dimension, and replace scalar variables by the specified values.
+   * Integer values may be appended to real variables.  Only the
+   * variables that are extended are copied.
+   *
+   * @param rows Variables to append.
+   * @throws std::runtime_error if a variable does not exist, if real
+   * values are appended to an integer variable, or if dimensions do
+   * not match
+   */
+  void append(const json_data &rows) {
+    for (const auto &var : rows.vars_i_) {
+      if (contains_i(var.first)) {
+        auto &appended = vars_i_.at(var.first);
+        appended = append_rows(var.first, appended, var.second);
+      } else if (contains_r_only(var.first)) {
+        std::shared_ptr<const var_r> real_var = std::make_shared<var_r>(
+            std::vector<double>(var.second->first.begin(),
+                                var.second->first.end()),
+            var.second->second);
+        auto &appended = vars_r_.at(var.first);
+        appended = append_rows(var.first, appended, real_var);
+      } else {
+        throw std::runtime_error(
+            "cannot append to variable that does not exist; variable name="
+            + var.first);
+      }
+    }
+    for (const auto &var : rows.vars_r_) {
+      if (contains_i(var.first))
+        throw std::runtime_error(
+            "cannot append non-int values to int variable; variable name="
+            + var.first);
+      if (!contains_r_only(var.first))
+        throw std::runtime_error(
+            "cannot append to variable that does not exist; variable name="
+            + var.first);
+      auto &appended = vars_r_.at(var.first);
+      appended = append_rows(var.first, appended, var.second);
+    }
+  }
+
+#ifdef STAN_THREADS
+  /**
+   * Parse the members of the specified text, which holds a single
+   * object, in parallel, each into maps of its own that are then
+   * moved into this object's maps, and return <code>true</code>.
+   * Return <code>false</code> without changing this object if there
+   * is only one thread or one member, if keys are repeated, or if any
+   * member fails to parse, so that the text is parsed sequentially,
+   * reporting the first error in the text.
+   *
+   * @param begin pointer to first character of text
+   * @param end pointer to one past the last character of text
+   * @return <code>true</code> if the text was parsed
+   */
+  bool parse_members_parallel(const char *begin, const char *end) {
+    if (tbb::this_task_arena::max_concurrency() < 2)
+      return false;
+    std::vector<json_member> members;
+    if (!split_members(begin, end, members) || members.size() < 2)
+      return false;
+    std::unordered_set<std::string> keys;
+    for (const json_member &member : members)
+      if (!keys.insert(member.key).second)
+        return false;
+
+    std::vector<vars_map_r> vars_r(members.size());
+    std::vector<vars_map_i> vars_i(members.size());
+    std::vector<char> parsed(members.size(), false);
+    tbb::parallel_for(
+        tbb::blocked_range<std::size_t>(0, members.size(), 1),
+        [&](const tbb::blocked_range<std::size_t> &r) {
+          for (std::size_t n = r.begin(); n != r.end(); ++n) {
+            try {
+              json_data_handler handler(vars_r[n], vars_i[n]);
+              json_fast_parser<json_data_handler> parser(
+                  members[n].begin, members[n].end, handler);
+              parsed[n] = parser.parse_member(members[n].key);
+            } catch (const json_error &) {
+            }
+          }
+        });
+    for (char member_parsed : parsed)
+      if (!member_parsed)
+        return false;
+
+    for (std::size_t n = 0; n < members.size(); ++n)
+      share(vars_r[n], vars_i[n]);
+    return true;
+  }
+#endif
+
  public:
   /**
    * Construct a json_data object from the specified input stream.
+   * The stream is parsed with rapidjson as it is read, so no copy of
+   * the text is held in memory.  Large files are parsed faster by
+   * mapping them into memory and using the constructor for a range
+   * of characters, which may parse variables in parallel.
    *
    * <b>Warning:</b> This method does not close the input stream.
    *
@@ -71,8 +278,92 @@ class json_data : public stan::io::var_context {
    * @throws json_exception if data is not well-formed stan data declaration
    */
   explicit json_data(std::istream &in) : vars_r_(), vars_i_() {
-    json_data_handler handler(vars_r_, vars_i_);
+    vars_map_r vars_r;
+    vars_map_i vars_i;
+    json_data_handler handler(vars_r, vars_i);
     rapidjson_parse(in, handler);
+    share(vars_r, vars_i);
+  }
+
+  /**
+   * Construct a json_data object from the JSON text in the specified
+   * range of characters, which need not be null terminated.
+   *
+   * @param begin Pointer to first character of text.
+   * @param end Pointer to one past the last character of text.
+   * @throws json_exception if data is not well-formed stan data declaration
+   */
+  json_data(const char *begin, const char *end) : vars_r_(), vars_i_() {
+#ifdef STAN_THREADS
+    if (parse_members_parallel(begin, end))
+      return;
+#endif
+    vars_map_r vars_r;
+    vars_map_i vars_i;
+    json_data_handler handler(vars_r, vars_i);
+    json_parse(begin, end, handler);
+    share(vars_r, vars_i);
+  }
+
+  /**
+   * Construct a json_data object from the specified JSON text.
+   *
+   * @param text JSON text to parse.
+   * @throws json_exception if data is not well-formed stan data declaration
+   */
+  explicit json_data(const std::string &text)
+      : json_data(text.data(), text.data() + text.size()) {}
+
+  /**
+   * Construct a json_data object holding a copy of the variables of
+   * the specified context.  If the context is a json_data object, the
+   * copy shares its variables, taking time linear in the number of
+   * variables rather than in their size.
+   *
+   * @param context Variables to copy.
+   */
+  explicit json_data(const stan::io::var_context &context)
+      : vars_r_(), vars_i_() {
+    const json_data *data = dynamic_cast<const json_data *>(&context);
+    if (data != nullptr) {
+      vars_r_ = data->vars_r_;
+      vars_i_ = data->vars_i_;
+      return;
+    }
+    std::vector<std::string> names;
+    context.names_i(names);
+    for (const std::string &name : names)
+      vars_i_[name] = std::make_shared<var_i>(context.vals_i(name),
+                                              context.dims_i(name));
+    context.names_r(names);
+    for (const std::string &name : names)
+      if (!contains_i(name))
+        vars_r_[name] = std::make_shared<var_r>(context.vals_r(name),
+                                                context.dims_r(name));
+  }
+
+  /**
+   * Construct a json_data object holding a copy of the variables of
+   * the specified context, with the rows of the variables of the same
+   * names in the specified object appended along their first
+   * dimension, and with scalar variables replaced by the specified
+   * values.  Integer values may be appended to real variables.  The
+   * context is not changed, so it may be read concurrently.  If the
+   * context is a json_data object, the variables without appended
+   * rows are shared with it and only the extended variables are
+   * copied, so constructing the object takes time linear in the number
+   * of variables plus the size of the extended variables; otherwise
+   * the whole data is copied.
+   *
+   * @param context Variables to copy.
+   * @param rows Variables to append.
+   * @throws std::runtime_error if a variable does not exist, if real
+   * values are appended to an integer variable, or if dimensions do
+   * not match
+   */
+  json_data(const stan::io::var_context &context, const json_data &rows)
+      : json_data(context) {
+    append(rows);
   }
 
   /**
@@ -107,15 +398,13 @@ class json_data : public stan::io::var_context {
    * @return Values of variable.
    */
   std::vector<double> vals_r(const std::string &name) const {
-    if (contains_r_only(name)) {
-      return (vars_r_.find(name)->second).first;
-    } else if (contains_i(name)) {
-      std::vector<int> vec_int = (vars_i_.find(name)->second).first;
-      std::vector<double> vec_r(vec_int.size());
-      for (size_t ii = 0; ii < vec_int.size(); ii++) {
-        vec_r[ii] = vec_int[ii];
-      }
-      return vec_r;
+    auto it_r = vars_r_.find(name);
+    if (it_r != vars_r_.end())
+      return it_r->second->first;
+    auto it_i = vars_i_.find(name);
+    if (it_i != vars_i_.end()) {
+      const std::vector<int> &vec_int = it_i->second->first;
+      return std::vector<double>(vec_int.begin(), vec_int.end());
     }
     return empty_vec_r_;
   }
@@ -129,7 +418,7 @@ class json_data : public stan::io::var_context {
    */
   std::vector<std::complex<double>> vals_c(const std::string &name) const {
     if (contains_r_only(name)) {
-      auto &&vec_r = (vars_r_.find(name)->second);
+      auto &&vec_r = *(vars_r_.find(name)->second);
       auto &&val_r = vec_r.first;
       auto &&dim_r = vec_r.second;
       std::vector<std::complex<double>> vec_c(val_r.size() / 2);
@@ -142,7 +431,7 @@ class json_data : public stan::io::var_context {
       }
       return vec_c;
     } else if (contains_i(name)) {
-      auto &&vec_i = (vars_i_.find(name)->second);
+      auto &&vec_i = *(vars_i_.find(name)->second);
       auto &&val_i = vec_i.first;
       auto &&dim_i = vec_i.second;
       std::vector<std::complex<double>> vec_c(val_i.size() / 2);
@@ -168,9 +457,9 @@ class json_data : public stan::io::var_context {
    */
   std::vector<size_t> dims_r(const std::string &name) const {
     if (contains_r_only(name)) {
-      return (vars_r_.find(name)->second).second;
+      return vars_r_.find(name)->second->second;
     } else if (contains_i(name)) {
-      return (vars_i_.find(name)->second).second;
+      return vars_i_.find(name)->second->second;
     }
     return empty_vec_ui_;
   }
@@ -184,7 +473,7 @@ class json_data : public stan::io::var_context {
    */
   std::vector<int> vals_i(const std::string &name) const {
     if (contains_i(name)) {
-      return (vars_i_.find(name)->second).first;
+      return vars_i_.find(name)->second->first;
     }
     return empty_vec_i_;
   }
@@ -198,7 +487,7 @@ class json_data : public stan::io::var_context {
    */
   std::vector<size_t> dims_i(const std::string &name) const {
     if (contains_i(name)) {
-      return (vars_i_.find(name)->second).second;
+      return vars_i_.find(name)->second->second;
     }
     return empty_vec_ui_;
   }
@@ -211,9 +500,8 @@ class json_data : public stan::io::var_context {
    */
   virtual void names_r(std::vector<std::string> &names) const {
     names.resize(0);
-    for (vars_map_r::const_iterator it = vars_r_.begin(); it != vars_r_.end();
-         ++it)
-      names.push_back((*it).first);
+    for (const auto &var : vars_r_)
+      names.push_back(var.first);
   }
 
   /**
@@ -224,9 +512,8 @@ class json_data : public stan::io::var_context {
    */
   virtual void names_i(std::vector<std::string> &names) const {
     names.resize(0);
-    for (vars_map_i::const_iterator it = vars_i_.begin(); it != vars_i_.end();
-         ++it)
-      names.push_back((*it).first);
+    for (const auto &var : vars_i_)
+      names.push_back(var.first);
   }
 
   /**
@@ -8,9 +8,9 @@
 #include <cctype>
 #include <iostream>
 #include <limits>
-#include <map>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -18,11 +18,12 @@ namespace cmdstan {
 
 namespace json {
 
-typedef std::map<std::string,
-                 std::pair<std::vector<double>, std::vector<size_t>>>
+typedef std::unordered_map<
+    std::string, std::pair<std::vector<double>, std::vector<size_t>>>
     vars_map_r;
 
-typedef std::map<std::string, std::pair<std::vector<int>, std::vector<size_t>>>
+typedef std::unordered_map<
+    std::string, std::pair<std::vector<int>, std::vector<size_t>>>
     vars_map_i;
 
 /**
@@ -41,6 +42,11 @@ typedef std::map<std::string, std::pair<std::vector<int>, std::vector<size_t>>>
  * the strings \"-Inf\" and \"-Infinity\" are mapped to negative infinity,
  * and the string \"NaN\" is mapped to not-a-number.
  * Bare versions of Infinity, -Infinity, and NaN are also allowed.
+ *
+ * <p>The values of each variable are accumulated in a single buffer,
+ * which is transposed to column-major order in place and moved into
+ * the map, so that parsing holds little more than one copy of the
+ * numeric data.
  */
 class json_data_handler : public cmdstan::json::json_handler {
  private:
@@ -155,9 +161,8 @@ class json_data_handler : public cmdstan::json::json_handler {
 
   void promote_to_double() {
     if (is_int_) {
-      for (std::vector<int>::iterator it = values_i_.begin();
-           it != values_i_.end(); ++it)
-        values_r_.push_back(*it);
+      values_r_.assign(values_i_.begin(), values_i_.end());
+      std::vector<int>().swap(values_i_);  // release memory
       is_int_ = false;
     }
   }
@@ -255,28 +260,18 @@ class json_data_handler : public cmdstan::json::json_handler {
       throw json_error(errorMsg.str());
     }
 
-    // transpose order of array values to column-major
+    // transpose order of array values to column-major and move the
+    // values into the map rather than copying them
     if (is_int_) {
-      std::pair<std::vector<int>, std::vector<size_t>> pair;
-      if (dims_.size() > 1) {
-        std::vector<int> cm_values_i(values_i_.size());
-        to_column_major(cm_values_i, values_i_, dims_);
-        pair = make_pair(cm_values_i, dims_);
-
-      } else {
-        pair = make_pair(values_i_, dims_);
-      }
-      vars_i_[key_] = pair;
+      if (dims_.size() > 1)
+        to_column_major(values_i_, dims_);
+      vars_i_.emplace(key_, std::make_pair(std::move(values_i_),
+                                           std::move(dims_)));
     } else {
-      std::pair<std::vector<double>, std::vector<size_t>> pair;
-      if (dims_.size() > 1) {
-        std::vector<double> cm_values_r(values_r_.size());
-        to_column_major(cm_values_r, values_r_, dims_);
-        pair = make_pair(cm_values_r, dims_);
-      } else {
-        pair = make_pair(values_r_, dims_);
-      }
-      vars_r_[key_] = pair;
+      if (dims_.size() > 1)
+        to_column_major(values_r_, dims_);
+      vars_r_.emplace(key_, std::make_pair(std::move(values_r_),
+                                           std::move(dims_)));
     }
   }
 
@@ -289,12 +284,28 @@ class json_data_handler : public cmdstan::json::json_handler {
     }
   }
 
+  /**
+   * Permute the specified values from row-major to column-major order
+   * in place by following the cycles of the permutation, using one
+   * bit per value to mark those already moved.
+   *
+   * @tparam T type of values
+   * @param vals values in row-major order, replaced by column-major
+   * @param dims dimensions of array
+   */
   template <typename T>
-  void to_column_major(std::vector<T> &cm_vals, const std::vector<T> &rm_vals,
-                       const std::vector<size_t> &dims) {
-    for (size_t i = 0; i < rm_vals.size(); i++) {
-      size_t idx = convert_offset_rtl_2_ltr(i, dims);
-      cm_vals[idx] = rm_vals[i];
+  void to_column_major(std::vector<T> &vals, const std::vector<size_t> &dims) {
+    std::vector<bool> moved(vals.size(), false);
+    for (size_t start = 0; start < vals.size(); start++) {
+      if (moved[start])
+        continue;
+      T carry = vals[start];
+      size_t i = start;
+      do {
+        i = convert_offset_rtl_2_ltr(i, dims);
+        std::swap(carry, vals[i]);
+        moved[i] = true;
+      } while (i != start);
     }
   }
 
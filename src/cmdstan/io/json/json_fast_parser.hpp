@@ -0,0 +1,502 @@
+#ifndef CMDSTAN_IO_JSON_JSON_FAST_PARSER_HPP
+#define CMDSTAN_IO_JSON_JSON_FAST_PARSER_HPP
+
+#include <cmdstan/io/json/rapidjson_parser.hpp>
+#include <rapidjson/memorystream.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace cmdstan {
+namespace json {
+
+/**
+ * Parser for the subset of JSON used by well-formed data files: a
+ * single object whose keys are plain strings and whose values are
+ * numbers, the strings for infinities and not-a-number, and arrays of
+ * them.  It sends the same events to the handler as
+ * <code>rapidjson_parse</code>, but parses a buffer holding the whole
+ * text rather than reading a stream a character at a time, and
+ * converts numbers without going through arbitrary precision.
+ *
+ * <p>Digits are consumed eight at a time with word-sized arithmetic,
+ * and numbers with at most 19 significant digits whose value is
+ * exactly a double times or divided by an exact power of ten are
+ * converted with a single floating-point operation, which is
+ * correctly rounded.  Other numbers fall back to
+ * <code>std::strtod</code>, which is also correctly rounded, so the
+ * values are identical to those of rapidjson's full-precision mode.
+ *
+ * <p>Input outside the subset, such as escaped strings, non-ASCII
+ * keys, or any syntax error, makes <code>parse()</code> return
+ * <code>false</code> so that the caller can reparse the text with
+ * rapidjson for full generality and its error messages.
+ *
+ * @tparam Handler type of handler receiving parse events
+ */
+template <typename Handler>
+class json_fast_parser {
+ private:
+  const char *p_;
+  const char *end_;
+  Handler &h_;
+  std::string str_;
+
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+  void skip_ws() {
+    while (p_ != end_
+           && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t'))
+      ++p_;
+  }
+
+  /**
+   * Return <code>true</code> if the eight characters starting at the
+   * specified position are all decimal digits.
+   */
+  static bool is_eight_digits(const char *p) {
+    std::uint64_t val;
+    std::memcpy(&val, p, sizeof(val));
+    return ((val & 0xF0F0F0F0F0F0F0F0ULL)
+            | (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+           == 0x3333333333333333ULL;
+  }
+
+  /**
+   * Return the value of the eight decimal digits starting at the
+   * specified position, combining pairs, then quadruples, then both
+   * halves of the little-endian word.
+   */
+  static std::uint64_t parse_eight_digits(const char *p) {
+    std::uint64_t val;
+    std::memcpy(&val, p, sizeof(val));
+    val = (val & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+    val = (val & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+    return (val & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32;
+  }
+
+  /**
+   * Consume a run of decimal digits, accumulating up to 19 of them
+   * into the specified mantissa and counting them, and setting the
+   * overflow flag if there are more.
+   *
+   * @param[in, out] m mantissa
+   * @param[in, out] num_digits number of digits accumulated
+   * @param[in, out] overflow <code>true</code> if digits were dropped
+   * @return number of digits consumed
+   */
+  std::size_t parse_digits(std::uint64_t &m, int &num_digits, bool &overflow) {
+    const char *start = p_;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end_ - p_ >= 8 && num_digits <= 11 && is_eight_digits(p_)) {
+      m = m * 100000000 + parse_eight_digits(p_);
+      num_digits += 8;
+      p_ += 8;
+    }
+#endif
+    for (; p_ != end_ && is_digit(*p_); ++p_) {
+      if (num_digits < 19) {
+        m = m * 10 + (*p_ - '0');
+        ++num_digits;
+      } else {
+        overflow = true;
+      }
+    }
+    return p_ - start;
+  }
+
+  /**
+   * Parse the bare literals <code>NaN</code>, <code>Inf</code>, and
+   * <code>Infinity</code> accepted by rapidjson, with the sign already
+   * consumed.  As in rapidjson, the sign is ignored for NaN.
+   */
+  bool parse_nan_inf(bool minus) {
+    if (end_ - p_ >= 3 && std::memcmp(p_, "NaN", 3) == 0) {
+      p_ += 3;
+      h_.number_double(std::numeric_limits<double>::quiet_NaN());
+      return true;
+    }
+    double x;
+    if (end_ - p_ >= 8 && std::memcmp(p_, "Infinity", 8) == 0) {
+      x = std::numeric_limits<double>::infinity();
+      p_ += 8;
+    } else if (end_ - p_ >= 3 && std::memcmp(p_, "Inf", 3) == 0) {
+      x = std::numeric_limits<double>::infinity();
+      p_ += 3;
+    } else {
+      return false;
+    }
+    h_.number_double(minus ? -x : x);
+    return true;
+  }
+
+  bool parse_number() {
+    static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                   1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                   1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = p_;
+    bool minus = *p_ == '-';
+    if (minus)
+      ++p_;
+    if (p_ == end_)
+      return false;
+    if (*p_ == 'N' || *p_ == 'I')
+      return parse_nan_inf(minus);
+
+    std::uint64_t m = 0;
+    int num_digits = 0;
+    bool overflow = false;
+    if (*p_ == '0') {
+      ++p_;
+    } else if (parse_digits(m, num_digits, overflow) == 0) {
+      return false;
+    }
+    bool is_int = true;
+    int exponent = 0;
+    if (p_ != end_ && *p_ == '.') {
+      ++p_;
+      is_int = false;
+      int int_digits = num_digits;
+      if (parse_digits(m, num_digits, overflow) == 0)
+        return false;
+      exponent -= num_digits - int_digits;
+    }
+    if (p_ != end_ && (*p_ == 'e' || *p_ == 'E')) {
+      ++p_;
+      is_int = false;
+      bool exp_minus = false;
+      if (p_ != end_ && (*p_ == '+' || *p_ == '-'))
+        exp_minus = *p_++ == '-';
+      if (p_ == end_ || !is_digit(*p_))
+        return false;
+      int exp = 0;
+      for (; p_ != end_ && is_digit(*p_); ++p_)
+        if (exp < 100000)
+          exp = exp * 10 + (*p_ - '0');
+      exponent += exp_minus ? -exp : exp;
+    }
+
+    if (is_int && !overflow) {
+      // same events as rapidjson, whose 64-bit integers the handler
+      // converts to double
+      if (minus) {
+        if (m <= 2147483648ULL)
+          h_.number_int(static_cast<int>(-static_cast<std::int64_t>(m)));
+        else
+          h_.number_double(-static_cast<double>(m));
+      } else {
+        if (m <= std::numeric_limits<unsigned>::max())
+          h_.number_unsigned_int(static_cast<unsigned>(m));
+        else
+          h_.number_double(static_cast<double>(m));
+      }
+      return true;
+    }
+    double x;
+    if (!overflow && m <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+      x = static_cast<double>(m);
+      x = exponent < 0 ? x / pow10[-exponent] : x * pow10[exponent];
+      if (minus)
+        x = -x;
+    } else {
+      char *num_end;
+      x = std::strtod(start, &num_end);
+      if (num_end != p_ || std::isinf(x))
+        return false;
+    }
+    h_.number_double(x);
+    return true;
+  }
+
+  /**
+   * Parse a string without escapes or non-ASCII characters into the
+   * string buffer.
+   */
+  bool parse_string() {
+    const char *start = ++p_;
+    for (; p_ != end_ && *p_ != '"'; ++p_) {
+      unsigned char c = static_cast<unsigned char>(*p_);
+      if (c < 0x20 || c >= 0x80 || c == '\\')
+        return false;
+    }
+    if (p_ == end_)
+      return false;
+    str_.assign(start, p_);
+    ++p_;
+    return true;
+  }
+
+  bool parse_array() {
+    ++p_;
+    h_.start_array();
+    skip_ws();
+    if (p_ != end_ && *p_ == ']') {
+      ++p_;
+      h_.end_array();
+      return true;
+    }
+    while (true) {
+      if (!parse_value())
+        return false;
+      skip_ws();
+      if (p_ == end_)
+        return false;
+      if (*p_ == ']') {
+        ++p_;
+        h_.end_array();
+        return true;
+      }
+      if (*p_ != ',')
+        return false;
+      ++p_;
+      skip_ws();
+    }
+  }
+
+  bool parse_value() {
+    if (p_ == end_)
+      return false;
+    char c = *p_;
+    if (c == '[')
+      return parse_array();
+    if (c == '-' || is_digit(c) || c == 'N' || c == 'I')
+      return parse_number();
+    if (c == '"') {
+      if (!parse_string())
+        return false;
+      h_.string(str_);
+      return true;
+    }
+    return false;
+  }
+
+ public:
+  /**
+   * Construct a parser for the specified text.  The character at
+   * <code>end</code> must be readable and not part of a number, such
+   * as the terminating null of a string.
+   *
+   * @param begin pointer to first character of text
+   * @param end pointer to one past the last character of text
+   * @param h handler for parse events
+   */
+  json_fast_parser(const char *begin, const char *end, Handler &h)
+      : p_(begin), end_(end), h_(h), str_() {}
+
+  /**
+   * Parse the text, sending events to the handler, and return
+   * <code>true</code>, or return <code>false</code> if the text is
+   * outside the subset this parser accepts.  Errors raised by the
+   * handler are thrown as for <code>rapidjson_parse</code>.
+   *
+   * @return <code>true</code> if the text was parsed
+   * @throws json_error if the handler rejects the data
+   */
+  bool parse() {
+    h_.start_text();
+    skip_ws();
+    if (p_ == end_ || *p_ != '{')
+      return false;
+    ++p_;
+    h_.start_object();
+    skip_ws();
+    if (p_ != end_ && *p_ == '}') {
+      ++p_;
+    } else {
+      while (true) {
+        if (p_ == end_ || *p_ != '"' || !parse_string())
+          return false;
+        h_.key(str_);
+        skip_ws();
+        if (p_ == end_ || *p_ != ':')
+          return false;
+        ++p_;
+        skip_ws();
+        if (!parse_value())
+          return false;
+        skip_ws();
+        if (p_ == end_)
+          return false;
+        if (*p_ == '}') {
+          ++p_;
+          break;
+        }
+        if (*p_ != ',')
+          return false;
+        ++p_;
+        skip_ws();
+      }
+    }
+    h_.end_object();
+    skip_ws();
+    if (p_ != end_)
+      return false;
+    h_.end_text();
+    return true;
+  }
+
+  /**
+   * Parse the text as the value of a single member of an object with
+   * the specified key, sending the events for a whole text holding
+   * just that member, and return <code>true</code>, or return
+   * <code>false</code> if the value is outside the subset this parser
+   * accepts.
+   *
+   * @param key key of member
+   * @return <code>true</code> if the value was parsed
+   * @throws json_error if the handler rejects the data
+   */
+  bool parse_member(const std::string &key) {
+    h_.start_text();
+    h_.start_object();
+    h_.key(key);
+    skip_ws();
+    if (!parse_value())
+      return false;
+    skip_ws();
+    if (p_ != end_)
+      return false;
+    h_.end_object();
+    h_.end_text();
+    return true;
+  }
+};
+
+/**
+ * Key and text of the value of a member of a top-level object.
+ */
+struct json_member {
+  std::string key;
+  const char *begin;
+  const char *end;
+};
+
+/**
+ * Split the specified text holding a single object into its members
+ * without parsing their values, tracking only the nesting of brackets
+ * and the extent of strings, and return <code>true</code>, or return
+ * <code>false</code> if the text is not an object, has keys with
+ * escapes, control characters, or non-ASCII characters, which the
+ * parsers validate, or has strings with escapes.  Values are only
+ * checked to be balanced.
+ *
+ * @param begin pointer to first character of text
+ * @param end pointer to one past the last character of text
+ * @param[out] members members of the object in order
+ * @return <code>true</code> if the text was split
+ */
+inline bool split_members(const char *begin, const char *end,
+                          std::vector<json_member> &members) {
+  auto is_ws = [](char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  };
+  const char *p = begin;
+  while (p != end && is_ws(*p))
+    ++p;
+  if (p == end || *p != '{')
+    return false;
+  ++p;
+  while (true) {
+    while (p != end && is_ws(*p))
+      ++p;
+    if (p == end || *p != '"')
+      return false;
+    const char *key = ++p;
+    for (; p != end && *p != '"'; ++p) {
+      unsigned char c = static_cast<unsigned char>(*p);
+      if (c < 0x20 || c >= 0x80 || c == '\\')
+        return false;
+    }
+    if (p == end)
+      return false;
+    json_member member{std::string(key, p), nullptr, nullptr};
+    ++p;
+    while (p != end && is_ws(*p))
+      ++p;
+    if (p == end || *p != ':')
+      return false;
+    member.begin = ++p;
+    int depth = 0;
+    for (; p != end; ++p) {
+      char c = *p;
+      if (c == '"') {
+        for (++p; p != end && *p != '"'; ++p)
+          if (*p == '\\')
+            return false;
+        if (p == end)
+          return false;
+      } else if (c == '[' || c == '{') {
+        ++depth;
+      } else if (c == ']' || c == '}') {
+        if (depth == 0)
+          break;
+        --depth;
+      } else if (c == ',' && depth == 0) {
+        break;
+      }
+    }
+    if (p == end)
+      return false;
+    member.end = p;
+    members.push_back(std::move(member));
+    if (*p++ == '}')
+      break;
+  }
+  while (p != end && is_ws(*p))
+    ++p;
+  return p == end;
+}
+
+/**
+ * Parse the specified JSON text, sending events to the specified
+ * handler, with <code>json_fast_parser</code>, falling back to
+ * rapidjson if the text is outside its subset.  The text need not be
+ * followed by a readable character, so it may be a memory-mapped
+ * file: the fast parser is only used if the text ends with the
+ * closing brace of an object, which no number can run past.
+ *
+ * @tparam Handler
+ * @param begin pointer to first character of text
+ * @param end pointer to one past the last character of text
+ * @param handler Handler for events from parser
+ * @throws json_error if the text is not well-formed Stan data
+ */
+template <typename Handler>
+void json_parse(const char *begin, const char *end, Handler &handler) {
+  const char *last = end;
+  while (last != begin
+         && (last[-1] == ' ' || last[-1] == '\n' || last[-1] == '\r'
+             || last[-1] == '\t'))
+    --last;
+  if (last != begin && last[-1] == '}') {
+    json_fast_parser<Handler> parser(begin, end, handler);
+    if (parser.parse())
+      return;
+  }
+  rapidjson::MemoryStream stream(begin, end - begin);
+  rapidjson_parse_stream(stream, handler);
+}
+
+/**
+ * Parse the specified JSON text, sending events to the specified
+ * handler, as <code>json_parse</code> does for a range of characters.
+ *
+ * @tparam Handler
+ * @param text JSON text to parse
+ * @param handler Handler for events from parser
+ * @throws json_error if the text is not well-formed Stan data
+ */
+template <typename Handler>
+void json_parse(const std::string &text, Handler &handler) {
+  json_parse(text.data(), text.data() + text.size(), handler);
+}
+
+}  // namespace json
+}  // namespace cmdstan
+#endif
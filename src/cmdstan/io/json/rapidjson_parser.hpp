@@ -100,22 +100,22 @@ struct RapidJSONHandler {
 };
 
 /**
- * Parse the JSON text represented by the specified input stream,
+ * Parse the JSON text read from the specified rapidjson stream,
  * sending events to the specified handler.
  *
+ * @tparam Stream type of rapidjson input stream
  * @tparam Handler
- * @param in Input stream from which to parse
+ * @param stream rapidjson input stream from which to parse
  * @param handler Handler for events from parser
  */
-template <typename Handler>
-void rapidjson_parse(std::istream &in, Handler &handler) {
+template <typename Stream, typename Handler>
+void rapidjson_parse_stream(Stream &stream, Handler &handler) {
   rapidjson::Reader reader;
   RapidJSONHandler<Handler> filter(handler);
-  rapidjson::IStreamWrapper isw(in);
   handler.start_text();
   if (!reader.Parse<rapidjson::kParseNanAndInfFlag
                     | rapidjson::kParseValidateEncodingFlag
-                    | rapidjson::kParseFullPrecisionFlag>(isw, filter)) {
+                    | rapidjson::kParseFullPrecisionFlag>(stream, filter)) {
     rapidjson::ParseErrorCode err = reader.GetParseErrorCode();
     std::stringstream ss;
     ss << "Error in JSON parsing " << std::endl
@@ -129,6 +129,20 @@ void rapidjson_parse(std::istream &in, Handler &handler) {
   }
   handler.end_text();
 }
+
+/**
+ * Parse the JSON text represented by the specified input stream,
+ * sending events to the specified handler.
+ *
+ * @tparam Handler
+ * @param in Input stream from which to parse
+ * @param handler Handler for events from parser
+ */
+template <typename Handler>
+void rapidjson_parse(std::istream &in, Handler &handler) {
+  rapidjson::IStreamWrapper isw(in);
+  rapidjson_parse_stream(isw, handler);
+}
 }  // namespace json
 }  // namespace cmdstan
 #endif
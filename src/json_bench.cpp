@@ -0,0 +1,133 @@
+#include <cmdstan/io/json/json_data_handler.hpp>
+#include <cmdstan/io/json/json_fast_parser.hpp>
+#include <cmdstan/io/json/rapidjson_parser.hpp>
+#include <server/mapped_file.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Write a synthetic data file of about the specified size, holding a
+ * real design matrix, an integer array of group indices, and a real
+ * vector with values over a wide range of magnitudes, each making up
+ * about a third of the file.
+ *
+ * @param[in] path path of file to write
+ * @param[in] size_mb approximate size of file in megabytes
+ */
+void write_data(const std::string& path, std::size_t size_mb) {
+  std::FILE* f = std::fopen(path.c_str(), "w");
+  if (f == nullptr)
+    throw std::runtime_error("Cannot write file: " + path);
+  std::mt19937_64 rng(1234);
+  std::normal_distribution<double> normal(0, 1);
+  std::uniform_int_distribution<int> group(1, 500);
+  std::uniform_int_distribution<int> magnitude(-30, 30);
+  std::size_t third = size_mb * (1 << 20) / 3;
+  const std::size_t cols = 50;
+  std::size_t rows = third / (cols * 10);
+  std::fprintf(f, "{\n\"N\": %zu,\n\"K\": %zu,\n\"X\": [", rows, cols);
+  for (std::size_t i = 0; i < rows; ++i) {
+    std::fputs(i == 0 ? "[" : ",\n[", f);
+    for (std::size_t j = 0; j < cols; ++j)
+      std::fprintf(f, j == 0 ? "%.6f" : ",%.6f", normal(rng));
+    std::fputc(']', f);
+  }
+  std::size_t num_groups = third / 4;
+  std::fprintf(f, "],\n\"g\": [");
+  for (std::size_t n = 0; n < num_groups; ++n)
+    std::fprintf(f, n == 0 ? "%d" : ",%d", group(rng));
+  std::size_t num_y = third / 24;
+  std::fprintf(f, "],\n\"y\": [");
+  for (std::size_t n = 0; n < num_y; ++n)
+    std::fprintf(f, n == 0 ? "%.17g" : ",%.17g",
+                 normal(rng) * std::pow(10.0, magnitude(rng)));
+  std::fprintf(f, "]\n}\n");
+  std::fclose(f);
+}
+
+/**
+ * Parse the specified file with the specified parse function into
+ * the specified maps and return the elapsed seconds.
+ *
+ * @tparam F type of parse function
+ * @param[in] path path of data file
+ * @param[in] parse function parsing the file at a path with a handler
+ * @param[out] vars_r real variables
+ * @param[out] vars_i integer variables
+ * @return seconds spent opening and parsing the file
+ */
+template <typename F>
+double time_parse(const std::string& path, const F& parse,
+                  cmdstan::json::vars_map_r& vars_r,
+                  cmdstan::json::vars_map_i& vars_i) {
+  auto start = std::chrono::steady_clock::now();
+  cmdstan::json::json_data_handler handler(vars_r, vars_i);
+  parse(path, handler);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                       - start).count();
+}
+
+/**
+ * Benchmark parsing a synthetic JSON data file with rapidjson reading
+ * from a stream, as the server did originally, and with the fast
+ * parser over the whole text mapped into memory, checking that both give the same
+ * variables.
+ *
+ * Usage: `json_bench [<size_mb> [<path>]]`, with a default size of
+ * 100 megabytes and file `json_bench.data.json`.  An existing file
+ * at the path is reused rather than regenerated.
+ *
+ * @param[in] argc number of command-line arguments (including executable)
+ * @param[in] argv command-line arguments in C string format
+ * @return 0 on success, 1 if the parsers disagree, and 2 on error
+ */
+int main(int argc, const char* argv[]) {
+  try {
+    std::size_t size_mb = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100;
+    std::string path = argc > 2 ? argv[2] : "json_bench.data.json";
+    if (!std::ifstream(path).good()) {
+      std::cout << "writing " << size_mb << " MB to " << path << std::endl;
+      write_data(path, size_mb);
+    }
+    std::ifstream in(path, std::ios::ate);
+    double mb = static_cast<double>(in.tellg()) / (1 << 20);
+
+    cmdstan::json::vars_map_r vars_r_stream, vars_r_fast;
+    cmdstan::json::vars_map_i vars_i_stream, vars_i_fast;
+    double stream_secs = time_parse(path,
+        [](const std::string& path,
+           cmdstan::json::json_data_handler& handler) {
+          std::ifstream in(path);
+          cmdstan::json::rapidjson_parse(in, handler);
+        }, vars_r_stream, vars_i_stream);
+    double fast_secs = time_parse(path,
+        [](const std::string& path,
+           cmdstan::json::json_data_handler& handler) {
+          mapped_file in(path);
+          cmdstan::json::json_parse(in.begin(), in.end(), handler);
+        }, vars_r_fast, vars_i_fast);
+
+    std::printf("file: %.1f MB\n", mb);
+    std::printf("rapidjson stream: %8.3f s  %8.1f MB/s\n", stream_secs,
+                mb / stream_secs);
+    std::printf("fast parser:      %8.3f s  %8.1f MB/s\n", fast_secs,
+                mb / fast_secs);
+    if (vars_r_stream != vars_r_fast || vars_i_stream != vars_i_fast) {
+      std::cerr << "ERROR: parsers disagree" << std::endl;
+      return 1;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 2;
+  }
+  return 0;
+}
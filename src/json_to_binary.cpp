@@ -0,0 +1,44 @@
+#include <cmdstan/io/json/json_data.hpp>
+#include <server/binary_data.hpp>
+#include <server/mapped_file.hpp>
+
+#include <exception>
+#include <fstream>
+#include <iostream>
+
+/**
+ * Convert a JSON data file to the binary data format read by the
+ * server (see `binary_data`), so that large data sets may be memory
+ * mapped rather than parsed each time a server starts.  Variables
+ * keep the types and dimensions that JSON parsing gives them.
+ *
+ * Usage: `json_to_binary <input.json> <output>`
+ *
+ * @param[in] argc number of command-line arguments (including executable)
+ * @param[in] argv command-line arguments in C string format
+ * @return 0 on success, 1 for bad usage, and 2 if conversion fails
+ */
+int main(int argc, const char* argv[]) {
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " <input.json> <output>"
+              << std::endl;
+    return 1;
+  }
+  try {
+    mapped_file in(argv[1]);
+    cmdstan::json::json_data data(in.begin(), in.end());
+    std::ofstream out(argv[2], std::ios::binary);
+    if (!out.good())
+      throw std::runtime_error(std::string("Cannot write output file: ")
+                               + argv[2]);
+    write_binary_data(data, out);
+    out.close();
+    if (!out)
+      throw std::runtime_error(std::string("Cannot write output file: ")
+                               + argv[2]);
+  } catch (const std::exception& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,223 @@
+#include <cmdstan/io/json/json_data.hpp>
+#include <server/binary_data.hpp>
+#include <server/log_density_table.hpp>
+#include <server/mapped_file.hpp>
+#include <stan/io/empty_var_context.hpp>
+#include <stan/math.hpp>
+#include <stan/model/model_base.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+stan::model::model_base& new_model(stan::io::var_context& data_context,
+                                   unsigned int seed,
+                                   std::ostream* msg_stream);
+
+/**
+ * Functor evaluating a log density function from a table, in the
+ * form required by `stan::math::gradient`.
+ */
+struct table_functor {
+  /** Stan model */
+  const stan::model::model_base& model_;
+
+  /** Log density function for autodiff variables */
+  log_prob_table<stan::math::var>::function log_prob_;
+
+  /** Output stream for messages from Stan model */
+  std::ostream& out_;
+
+  stan::math::var operator()(
+      const Eigen::Matrix<stan::math::var, Eigen::Dynamic, 1>& theta) const {
+    auto& params_r
+        = const_cast<Eigen::Matrix<stan::math::var, Eigen::Dynamic, 1>&>(
+            theta);
+    return log_prob_(model_, params_r, &out_);
+  }
+};
+
+/**
+ * Values computed from one log density function at one point: the log
+ * density, its gradient and, when the model supports it, the
+ * derivative of the log density in a fixed direction computed with
+ * nested forward- and reverse-mode autodiff.  If evaluating throws,
+ * only the error message is set.
+ */
+struct evaluation {
+  /** Log density in double precision */
+  double value_ = 0;
+
+  /** Log density computed with reverse-mode autodiff */
+  double var_value_ = 0;
+
+  /** Gradient of log density */
+  Eigen::VectorXd grad_;
+
+  /** Directional derivative of log density */
+  double tangent_ = 0;
+
+  /** Message of exception thrown by the evaluation, if any */
+  std::string error_;
+};
+
+/**
+ * Evaluate the log density function for each scalar type in the
+ * specified table with the specified flags at the specified point.
+ *
+ * @param[in] model Stan model
+ * @param[in] table log density functions of model
+ * @param[in] propto `true` if log density drops constant terms
+ * @param[in] jacobian `true` if log density includes change-of-variables
+ * terms
+ * @param[in] theta unconstrained parameters
+ * @return values computed
+ */
+evaluation evaluate(const stan::model::model_base& model,
+                    const log_density_table& table, bool propto,
+                    bool jacobian, const Eigen::VectorXd& theta) {
+  std::stringstream msgs;
+  evaluation eval;
+  try {
+    Eigen::VectorXd params_r = theta;
+    eval.value_ = table.log_prob<double>(propto, jacobian)(model, params_r,
+                                                           &msgs);
+    table_functor f{model, table.log_prob<stan::math::var>(propto, jacobian),
+                    msgs};
+    stan::math::gradient(f, theta, eval.var_value_, eval.grad_);
+#ifdef STAN_MODEL_FVAR_VAR
+    stan::math::nested_rev_autodiff nested;
+    Eigen::Matrix<stan::math::fvar<stan::math::var>, Eigen::Dynamic, 1>
+        params_fvar(theta.size());
+    for (int i = 0; i < theta.size(); ++i)
+      params_fvar(i) = {stan::math::var(theta(i)),
+                        stan::math::var(i % 2 ? -0.5 : 1.0)};
+    auto lp = table.log_prob<stan::math::fvar<stan::math::var>>(
+        propto, jacobian)(model, params_fvar, &msgs);
+    eval.tangent_ = lp.d_.val();
+#endif
+  } catch (const std::exception& e) {
+    eval.error_ = e.what();
+  }
+  return eval;
+}
+
+/**
+ * Return `true` if the specified values agree to within rounding, or
+ * are both not a number.
+ *
+ * @param[in] x value
+ * @param[in] y expected value
+ * @return `true` if values agree
+ */
+bool same(double x, double y) {
+  if (std::isnan(x) || std::isnan(y))
+    return std::isnan(x) && std::isnan(y);
+  return x == y || std::fabs(x - y) <= 1e-12 * std::max(1.0, std::fabs(y));
+}
+
+/**
+ * Return the differences between the specified evaluation from the
+ * concrete table and the specified expected evaluation through
+ * `model_base`, one per line, or an empty string if they agree.
+ *
+ * @param[in] concrete evaluation through the concrete table
+ * @param[in] expected evaluation through `model_base`
+ * @return description of differences
+ */
+std::string differences(const evaluation& concrete,
+                        const evaluation& expected) {
+  std::stringstream out;
+  out.precision(17);
+  if (concrete.error_ != expected.error_) {
+    out << "  error \"" << concrete.error_ << "\", expected \""
+        << expected.error_ << "\"\n";
+    return out.str();
+  }
+  if (!same(concrete.value_, expected.value_))
+    out << "  log density " << concrete.value_ << ", expected "
+        << expected.value_ << "\n";
+  if (!same(concrete.var_value_, expected.var_value_))
+    out << "  autodiff log density " << concrete.var_value_ << ", expected "
+        << expected.var_value_ << "\n";
+  for (int i = 0; i < expected.grad_.size(); ++i)
+    if (!same(concrete.grad_(i), expected.grad_(i)))
+      out << "  gradient[" << i << "] " << concrete.grad_(i) << ", expected "
+          << expected.grad_(i) << "\n";
+  if (!same(concrete.tangent_, expected.tangent_))
+    out << "  directional derivative " << concrete.tangent_ << ", expected "
+        << expected.tangent_ << "\n";
+  return out.str();
+}
+
+/**
+ * Test that the log density functions in the table filled for the
+ * concrete type of the model linked with this program return the same
+ * values as the `log_prob` functions of `model_base`, for every
+ * combination of dropping constants and including the
+ * change-of-variables adjustment, and for each scalar type, at a few
+ * unconstrained points.  Errors thrown by the model must match too.
+ *
+ * Usage: `<model>_table_test [<data file>]`, with no data by default.
+ * Data files may be JSON or in the binary data format.
+ *
+ * @param[in] argc number of command-line arguments (including executable)
+ * @param[in] argv command-line arguments in C string format
+ * @return 0 if all values agree, 1 if some differ and 2 on error
+ */
+int main(int argc, const char* argv[]) {
+  try {
+    std::string data_path = argc > 1 ? argv[1] : "";
+    std::unique_ptr<stan::model::model_base> model;
+    if (data_path == "") {
+      stan::io::empty_var_context data;
+      model.reset(&new_model(data, 1234, &std::cerr));
+    } else if (is_binary_data(data_path)) {
+      binary_data data(data_path);
+      model.reset(&new_model(data, 1234, &std::cerr));
+    } else {
+      mapped_file in(data_path);
+      cmdstan::json::json_data data(in.begin(), in.end());
+      model.reset(&new_model(data, 1234, &std::cerr));
+    }
+
+    log_density_table virtual_table
+        = make_log_density_table<stan::model::model_base>();
+    const log_density_table& concrete_table = model_log_density_table();
+    size_t num_params = model->num_params_r();
+    std::vector<Eigen::VectorXd> points(3, Eigen::VectorXd(num_params));
+    for (size_t i = 0; i < num_params; ++i) {
+      points[0](i) = 0;
+      points[1](i) = 0.1 * (i + 1) * (i % 2 ? -1 : 1);
+      points[2](i) = 2.5 - 0.75 * i;
+    }
+
+    int num_failed = 0;
+    for (bool propto : {false, true}) {
+      for (bool jacobian : {false, true}) {
+        for (size_t n = 0; n < points.size(); ++n) {
+          std::string diffs = differences(
+              evaluate(*model, concrete_table, propto, jacobian, points[n]),
+              evaluate(*model, virtual_table, propto, jacobian, points[n]));
+          if (diffs.empty())
+            continue;
+          ++num_failed;
+          std::printf("FAILED propto=%d jacobian=%d point %zu\n%s", propto,
+                      jacobian, n, diffs.c_str());
+        }
+      }
+    }
+    std::printf("%s: %d of %zu evaluations differ\n",
+                model->model_name().c_str(), num_failed, 4 * points.size());
+    return num_failed == 0 ? 0 : 1;
+  } catch (const std::exception& e) {
+    std::cerr << "ERROR: " << e.what() << std::endl;
+    return 2;
+  }
+}
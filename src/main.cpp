@@ -1,25 +1,55 @@
 #include <cmdstan/io/json/json_data.hpp>
+#include <server/binary_data.hpp>
+#include <server/draw_writer.hpp>
+#include <server/log_density_table.hpp>
+#include <server/mapped_file.hpp>
+#ifdef STAN_MODEL_SERVER_PLUGINS
+#include <server/model_library.hpp>
+#endif
+#include <server/protocol.hpp>
+#include <server/shared_memory.hpp>
+#include <server/socket.hpp>
+#include <server/stats.hpp>
+#include <stan/callbacks/interrupt.hpp>
+#include <stan/callbacks/stream_logger.hpp>
+#include <stan/callbacks/writer.hpp>
 #include <stan/math.hpp>
 #include <stan/io/empty_var_context.hpp>
 #include <stan/model/model_base.hpp>
+#include <stan/services/sample/hmc_nuts_diag_e_adapt.hpp>
 
 #include <CLI11/CLI11.hpp>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <iostream>
 #include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 /**
  * Allocate and return a new model as a reference given the specified
  * data context, seed, and message stream.  This function is defined
- * in the generated model class.
+ * in the generated model class.  Servers built with
+ * `STAN_MODEL_SERVER_PLUGINS` are not linked with a model and load
+ * it from a shared library instead (see `model_library`).
  *
  * @param[in] data_context context for reading model data
  * @param[in] seed random seed for transformed data block
@@ -43,16 +73,17 @@ void un_synch_un_autoflush_std_io_for_speed() {
 }
 
 /**
- * Functor for a model of the specified template type and its log
- * density configuration in terms of dropping constants and/or the
- * change-of-variables adjustment.
- *
- * @tparam M type of model
+ * Functor for a model and its log density configuration in terms of
+ * dropping constants and/or the change-of-variables adjustment.  The
+ * log density is evaluated through the model's table of log density
+ * functions (see `log_density_table`).
  */
-template <class M>
 struct model_functor {
   /** Stan model */
-  const M& model_;
+  const stan::model::model_base& model_;
+
+  /** Log density functions of model */
+  const log_density_table& table_;
 
   /** `true` if including constant terms */
   const bool propto_;
@@ -64,18 +95,23 @@ struct model_functor {
   std::ostream& out_;
 
   /**
-   * Construct a model functor from the specified model, output
-   * stream, and specification of whether constants should be dropped
-   * and whether the change-of-variables terms should be dropped.
+   * Construct a model functor from the specified model, its log
+   * density functions, output stream, and specification of whether
+   * constants should be dropped and whether the change-of-variables
+   * terms should be dropped.
    *
    * @param[in] m Stan model
+   * @param[in] table log density functions of model
    * @param[in] propto `true` if log density drops constant terms
    * @param[in] jacobian `true` if log density includes change-of-variables
    * terms
    * @param[in] out output stream for messages from model
    */
-  model_functor(const M& m, bool propto, bool jacobian, std::ostream& out)
-      : model_(m), propto_(propto), jacobian_(jacobian), out_(out) { }
+  model_functor(const stan::model::model_base& m,
+                const log_density_table& table, bool propto, bool jacobian,
+                std::ostream& out)
+      : model_(m), table_(table), propto_(propto), jacobian_(jacobian),
+        out_(out) { }
 
   /**
    * Return the log density for the specified unconstrained
@@ -89,112 +125,538 @@ struct model_functor {
   template <typename T>
   T operator()(const Eigen::Matrix<T, Eigen::Dynamic, 1>& theta) const {
     // const cast is safe---theta not modified
-    auto params_r = const_cast<Eigen::Matrix<T, Eigen::Dynamic, 1>&>(theta);
-    return propto_
-        ? (jacobian_
-           ? model_.template log_prob<true, true, T>(params_r, &out_)
-           : model_.template log_prob<true, false, T>(params_r, &out_))
-        : (jacobian_
-           ? model_.template log_prob<false, true, T>(params_r, &out_)
-           : model_.template log_prob<false, false, T>(params_r, &out_));
+    auto& params_r = const_cast<Eigen::Matrix<T, Eigen::Dynamic, 1>&>(theta);
+    return table_.log_prob<T>(propto_, jacobian_)(model_, params_r, &out_);
   }
 };
 
 /**
- * Return an appropriately typed model functor from the specified model, given
- * the specified output stream and flags indicating whether to drop  constant
- * terms and include change-of-variables terms.  Unlike the `model_functor` constructor,
- * this factory function provides type inference for `M`.
+ * Return a model functor for the specified model and its log density
+ * functions, given the specified output stream and flags indicating
+ * whether to drop constant terms and include change-of-variables
+ * terms.
  *
- * @tparam M type of Stan model
  * @param[in] m Stan model
+ * @param[in] table log density functions of model
  * @param[in] propto `true` if log density drops constant terms
  * @param[in] jacobian `true` if log density includes change-of-variables
  * terms
  * @param[in] out output stream for messages from model
  */
-template <typename M>
-model_functor<M> create_model_functor(const M& m, bool propto, bool jacobian,
-                                       std::ostream& out) {
-  return model_functor<M>(m, propto, jacobian, out);
+model_functor create_model_functor(const stan::model::model_base& m,
+                                   const log_density_table& table,
+                                   bool propto, bool jacobian,
+                                   std::ostream& out) {
+  return model_functor(m, table, propto, jacobian, out);
 }
 
 
+/**
+ * Codes for the REPL instructions.  The binary protocol identifies
+ * instructions by code and the text protocol by name.
+ */
+enum class instruction : std::uint16_t {
+  QUIT = 0,
+  NAME = 1,
+  PARAM_NAMES = 2,
+  PARAM_UNC_NAMES = 3,
+  PARAM_NUM = 4,
+  PARAM_UNC_NUM = 5,
+  PARAM_CONSTRAIN = 6,
+  PARAM_UNCONSTRAIN = 7,
+  LOG_DENSITY = 8,
+  LOG_DENSITY_BATCH = 9,
+  LOG_DENSITY_HVP = 10,
+  SHM_ATTACH = 11,
+  STATS = 12,
+  LEAPFROG = 13,
+  SAMPLE = 14,
+  PARAM_CONSTRAIN_BATCH = 15,
+  USE = 16,
+  LOAD_DATA = 17,
+  APPEND_DATA = 18,
+  UNKNOWN = 0xFFFF
+};
+
+/**
+ * Methods for computing Hessians, as given by the `hess` argument of
+ * the `log_density` instruction.
+ */
+enum hessian_method {
+  /** Do not compute the Hessian */
+  HESSIAN_NONE = 0,
+
+  /** Central finite differences of autodiff gradients */
+  HESSIAN_FINITE_DIFF = 1,
+
+  /** Nested forward-over-reverse autodiff */
+  HESSIAN_AUTODIFF = 2
+};
+
+/**
+ * Default maximum bytes of a binary request payload sent over the
+ * stream (see the `--max-payload` option).  Larger requests are
+ * discarded with an error rather than read into memory.
+ */
+constexpr std::uint64_t DEFAULT_MAX_PAYLOAD = std::uint64_t(1) << 30;
+
+/**
+ * Return the names and codes of the REPL instructions.
+ *
+ * @return sequence of instruction name and code pairs
+ */
+const std::vector<std::pair<std::string, instruction>>& instruction_codes() {
+  static const std::vector<std::pair<std::string, instruction>> codes = {
+    {"quit", instruction::QUIT},
+    {"name", instruction::NAME},
+    {"param_names", instruction::PARAM_NAMES},
+    {"param_unc_names", instruction::PARAM_UNC_NAMES},
+    {"param_num", instruction::PARAM_NUM},
+    {"param_unc_num", instruction::PARAM_UNC_NUM},
+    {"param_constrain", instruction::PARAM_CONSTRAIN},
+    {"param_unconstrain", instruction::PARAM_UNCONSTRAIN},
+    {"log_density", instruction::LOG_DENSITY},
+    {"log_density_batch", instruction::LOG_DENSITY_BATCH},
+    {"log_density_hvp", instruction::LOG_DENSITY_HVP},
+    {"shm_attach", instruction::SHM_ATTACH},
+    {"stats", instruction::STATS},
+    {"leapfrog", instruction::LEAPFROG},
+    {"sample", instruction::SAMPLE},
+    {"param_constrain_batch", instruction::PARAM_CONSTRAIN_BATCH},
+    {"use", instruction::USE},
+    {"load_data", instruction::LOAD_DATA},
+    {"append_data", instruction::APPEND_DATA}
+  };
+  return codes;
+}
+
+/**
+ * Return the code of the instruction with the specified name, or
+ * `instruction::UNKNOWN` if there is no such instruction.
+ *
+ * @param name name of instruction
+ * @return instruction code
+ */
+instruction instruction_code(const std::string& name) {
+  for (const auto& code : instruction_codes())
+    if (name == code.first)
+      return code.second;
+  return instruction::UNKNOWN;
+}
+
+/**
+ * Return the instruction with the specified binary code, or
+ * `instruction::UNKNOWN` if there is no such instruction.
+ *
+ * @param opcode binary instruction code
+ * @return instruction code
+ */
+instruction instruction_code(std::uint16_t opcode) {
+  for (const auto& code : instruction_codes())
+    if (opcode == static_cast<std::uint16_t>(code.second))
+      return code.second;
+  return instruction::UNKNOWN;
+}
+
+
+/**
+ * Return the data at the specified path, which is memory mapped if it
+ * is in the binary data format and mapped and parsed in place as JSON
+ * otherwise, or an empty context if the path is empty.
+ *
+ * @param[in] path path of data file, or empty for none
+ * @return data
+ * @throw std::runtime_error if there is an error reading the file
+ */
+std::shared_ptr<stan::io::var_context> read_data(const std::string& path) {
+  if (path == "")
+    return std::make_shared<stan::io::empty_var_context>();
+  if (is_binary_data(path))
+    return std::make_shared<binary_data>(path);
+  mapped_file file(path);
+  return std::make_shared<cmdstan::json::json_data>(file.begin(),
+                                                    file.end());
+}
+
+/**
+ * A named model instance held by the server: a model constructed from
+ * its data and seed, its log density functions, and the names of its
+ * parameters, which are computed once and shared by all sessions.
+ * An instance does not change once its model is created; loading new
+ * data creates a new instance that replaces it (see `model_registry`).
+ */
+struct model_instance {
+  /** Name by which requests select the instance */
+  std::string name_;
+
+#ifdef STAN_MODEL_SERVER_PLUGINS
+  /** Path of shared library defining the model */
+  std::string library_path_;
+
+  /**
+   * Shared library defining the model, shared with the instances
+   * replacing this one and unloaded after the last of their models is
+   * freed
+   */
+  std::shared_ptr<const model_library> library_;
+#endif
+
+  /** Path of data file, or empty for none or inline data */
+  std::string data_path_;
+
+  /**
+   * Data of the model, kept so that rows can be appended to a copy of
+   * it.  It does not change once the model is created.
+   */
+  std::shared_ptr<const stan::io::var_context> data_;
+
+  /** Random seed used to construct the model and seed sessions */
+  unsigned int seed_;
+
+  /** Stan model, owned by this instance */
+  stan::model::model_base* model_;
+
+  /** Log density functions of model */
+  const log_density_table* log_densities_;
+
+  /** Names of constrained parameters by `include_tp` and `include_gq` */
+  std::vector<std::string> param_names_[2][2];
+
+  /** Names of unconstrained parameters */
+  std::vector<std::string> param_unc_names_;
+
+  /**
+   * Construct an instance with the specified name and seed and no
+   * model yet.
+   *
+   * @param[in] name name of instance
+   * @param[in] seed random seed
+   */
+  model_instance(const std::string& name, unsigned int seed)
+      : name_(name), data_path_(), seed_(seed), model_(nullptr),
+        log_densities_(nullptr) { }
+
+  model_instance(const model_instance&) = delete;
+  model_instance& operator=(const model_instance&) = delete;
+
+  /**
+   * Free the model's memory.
+   */
+  ~model_instance() { delete model_; }
+
+  /**
+   * Return a new instance with the name, seed, and model library of
+   * this instance and no model yet, to replace this instance.
+   *
+   * @return new instance
+   */
+  std::shared_ptr<model_instance> replacement() const {
+    std::shared_ptr<model_instance> instance
+        = std::make_shared<model_instance>(name_, seed_);
+#ifdef STAN_MODEL_SERVER_PLUGINS
+    instance->library_path_ = library_path_;
+    instance->library_ = library_;
+#endif
+    return instance;
+  }
+
+  /**
+   * Allocate the model with the specified data, keep the data, and
+   * cache the model's parameter names.
+   *
+   * @param[in] data data for model
+   * @param[in] msgs stream for messages printed by the model
+   */
+  void create_model(std::shared_ptr<stan::io::var_context> data,
+                    std::ostream* msgs) {
+#ifdef STAN_MODEL_SERVER_PLUGINS
+    model_ = &library_->new_model(*data, seed_, msgs);
+    log_densities_ = &library_->log_densities();
+#else
+    model_ = &new_model(*data, seed_, msgs);
+    log_densities_ = &model_log_density_table();
+#endif
+    data_ = std::move(data);
+    cache_param_names();
+  }
+
+  /**
+   * Store the names of the constrained parameters for each
+   * combination of including transformed parameters and generated
+   * quantities, and the names of the unconstrained parameters, so
+   * that instructions need not ask the model for them.
+   */
+  void cache_param_names() {
+    for (int tp = 0; tp < 2; ++tp)
+      for (int gq = 0; gq < 2; ++gq) {
+        param_names_[tp][gq].clear();
+        model_->constrained_param_names(param_names_[tp][gq], tp, gq);
+      }
+    param_unc_names_.clear();
+    model_->unconstrained_param_names(param_unc_names_, false, false);
+  }
+};
+
+/**
+ * Model instances held by the server, in the order they were given.
+ * An instance may be replaced while sessions are using it: sessions
+ * hold their instance through a shared pointer, so a replaced
+ * instance is freed once the last request using it returns.  The
+ * generation counts replacements, so that sessions can check before
+ * each request, without locking, whether to fetch their instance
+ * again.  Each instance has an update mutex, held while creating its
+ * replacement, so that updates of an instance from several sessions
+ * apply one after another.
+ */
+class model_registry {
+ private:
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<const model_instance>> instances_;
+  std::deque<std::mutex> update_mutexes_;
+  std::atomic<std::uint64_t> generation_;
+
+ public:
+  model_registry()
+      : mutex_(), instances_(), update_mutexes_(), generation_(0) { }
+
+  /**
+   * Return the number of instances.
+   *
+   * @return number of instances
+   */
+  std::size_t size() const { return instances_.size(); }
+
+  /**
+   * Return the number of replacements so far.
+   *
+   * @return generation
+   */
+  std::uint64_t generation() const {
+    return generation_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Return the instance with the specified index.
+   *
+   * @param[in] n index of instance
+   * @return instance
+   */
+  std::shared_ptr<const model_instance> get(std::size_t n) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return instances_[n];
+  }
+
+  /**
+   * Return the index of the instance with the specified name, or the
+   * number of instances if there is none.
+   *
+   * @param[in] name name of instance
+   * @return index of instance
+   */
+  std::size_t find(const std::string& name) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t n = 0;
+    while (n < instances_.size() && instances_[n]->name_ != name)
+      ++n;
+    return n;
+  }
+
+  /**
+   * Add the specified instance, whose name must differ from those of
+   * the others, after the others.
+   *
+   * @param[in] instance instance to add
+   */
+  void add(std::shared_ptr<const model_instance> instance) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    instances_.push_back(std::move(instance));
+    update_mutexes_.emplace_back();
+  }
+
+  /**
+   * Return the update mutex of the instance with the specified index.
+   *
+   * @param[in] n index of instance
+   * @return update mutex
+   */
+  std::mutex& update_mutex(std::size_t n) { return update_mutexes_[n]; }
+
+  /**
+   * Replace the instance with the specified index by the specified
+   * instance.  The replaced instance is freed here, outside the lock,
+   * if no session holds it.
+   *
+   * @param[in] n index of instance
+   * @param[in] instance new instance
+   */
+  void replace(std::size_t n, std::shared_ptr<const model_instance> instance) {
+    std::shared_ptr<const model_instance> replaced;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      replaced = std::move(instances_[n]);
+      instances_[n] = std::move(instance);
+      generation_.fetch_add(1, std::memory_order_release);
+    }
+  }
+};
+
+
 /**
  * Class for managing the server read-evaluate-print loop (REPL).
- * Holds a reference to the model (its memory is managed by the config
- * object), the base pseudo-RNG reused through the server, and the input,
- * output, and error stream to use.
+ * Holds a reference to the model instances (managed by the config
+ * object), the instance that requests go to, a pseudo-RNG per
+ * instance reused through the session, and the input, output, and
+ * error stream to use.
  *
  * Standard server operation reads from the input stream, writes to
  * the output stream, and sends errors and messages from Stan programs
- * to the error stream.
+ * to the error stream.  Requests and responses are either lines of
+ * text or binary messages with a fixed header (see `binary_header`);
+ * both protocols share the same instructions.
+ *
+ * Batched instructions and sampler chains are evaluated in parallel when the
+ * server is built with `STAN_THREADS` and run with more than one thread;
+ * each TBB worker thread has its own autodiff stack.
+ *
+ * A binary client may attach a shared-memory segment, after which
+ * only headers travel over the input and output streams and payloads
+ * are read from and written to the segment in place.
+ *
+ * Unless the server is built with `STAN_MODEL_SERVER_NO_STATS`, the
+ * time spent parsing, evaluating, and serializing each request is
+ * recorded per instruction and reported by the `stats` instruction.
  */
 struct repl {
-  boost::ecuyer1988 base_rng_;
-  stan::model::model_base& model_;
+  model_registry& models_;
+  std::vector<boost::ecuyer1988> rngs_;
+  std::size_t instance_index_;
+  std::shared_ptr<const model_instance> instance_;
+  std::uint64_t generation_;
+  unsigned int seed_;
+  boost::ecuyer1988* base_rng_;
+  stan::model::model_base* model_;
+  const log_density_table* log_densities_;
   std::istream& in_;
   std::ostream& out_;
   std::ostream& err_;
+  bool binary_;
+  int num_threads_;
+  std::mutex err_mutex_;
+  std::vector<char> request_payload_;
+  std::vector<char> response_payload_;
+  std::unique_ptr<shared_memory> shm_;
+  std::unique_ptr<shared_memory> next_shm_;
+  bool shm_pending_;
+  std::string line_;
+  std::string instruction_name_;
+  std::string stat_;
+  std::string stat_name_;
+  Eigen::VectorXd params_unc_;
+  Eigen::VectorXd params_;
+  Eigen::VectorXd grad_;
+  Eigen::MatrixXd hess_;
+  Eigen::VectorXd rho_;
+  Eigen::VectorXd metric_;
+  Eigen::Matrix<stan::math::var, Eigen::Dynamic, 1> params_var_;
+  unsigned int session_;
+  std::string stats_file_;
+  std::uint64_t max_payload_;
+#ifndef STAN_MODEL_SERVER_NO_STATS
+  request_timer timer_;
+  std::vector<instruction_stats> instruction_stats_;
+#endif
 
   /**
-   * Construct a REPL with a base model, pseudo-RNG seed, input
-   * stream, output stream, and error stream.  The output and error
-   * stream use double-precision for printing floatoing-point numbers.
+   * Construct a REPL with the model instances, input stream, output
+   * stream, and error stream.  The output and error stream use
+   * double-precision for printing floatoing-point numbers.  Requests
+   * go to the first instance until the `use` instruction selects
+   * another.
    *
-   * @param[in] model Stan model
-   * @param[in] seed seed for pseudo-RNG
+   * @param[in] models model instances, at least one
    * @param[in] in input stream
    * @param[in] out output stream
    * @param[in] err error stream
+   * @param[in] binary `true` to use the binary protocol rather than text
+   * @param[in] num_threads number of threads for batched instructions
+   * and chains
+   * @param[in] session identifier of session, which selects a distinct
+   * stream of the pseudo-RNG of each instance
+   * @param[in] stats_file path of file to which to append statistics
+   * when the session ends, or empty for none
+   * @param[in] max_payload maximum bytes of a binary request payload
+   * sent over the stream rather than through shared memory
    */
-  repl(stan::model::model_base& model, uint seed,
-       std::istream& in, std::ostream& out, std::ostream& err)
-      : base_rng_(seed),
-        model_(model),
-        in_(in), out_(out), err_(err) {
-    base_rng_.discard(1000000000000L);
+  repl(model_registry& models, std::istream& in, std::ostream& out,
+       std::ostream& err, bool binary = false, int num_threads = 1,
+       unsigned int session = 0, const std::string& stats_file = "",
+       std::uint64_t max_payload = DEFAULT_MAX_PAYLOAD)
+      : models_(models), rngs_(), instance_index_(0), instance_(),
+        generation_(0), in_(in), out_(out), err_(err),
+        binary_(binary), num_threads_(num_threads), shm_pending_(false),
+        session_(session), stats_file_(stats_file),
+        max_payload_(max_payload) {
+    for (std::size_t n = 0; n < models_.size(); ++n) {
+      rngs_.emplace_back(models_.get(n)->seed_);
+      rngs_.back().discard(1000000000000L * (session + 1ULL));
+    }
+    select_model(0);
+#ifndef STAN_MODEL_SERVER_NO_STATS
+    std::size_t num_codes = 0;
+    for (const auto& code : instruction_codes())
+      num_codes = std::max(num_codes,
+                           static_cast<std::size_t>(code.second) + 1);
+    instruction_stats_.resize(num_codes);
+#endif
     out_ << std::setprecision(std::numeric_limits<double>::digits10);
     err_ << std::setprecision(std::numeric_limits<double>::digits10);
   }
 
   /**
    * Execute the read-eval-print loop until it returns `false` or
-   * throws an uncaught exception.
+   * throws an uncaught exception, then append the statistics to the
+   * statistics file if there is one.
    */
   void loop() {
     while (read_eval_print());
+    if (!stats_file_.empty())
+      write_stats_file();
   }
 
   /**
-   * Write elements of the container to the output stream separated by
-   * commas.
+   * Direct subsequent requests to the model instance with the
+   * specified index, with its own stream of the pseudo-RNG, and size
+   * the buffers for its parameters.  The session holds the instance
+   * until it selects an instance again, even if the instance is
+   * replaced in the meantime.
    *
-   * @tparam T container type
-   * @param[in] x container
+   * @param[in] n index of instance
    */
-  template <typename T>
-  void write_csv(T&& x) {
-    for (size_t i = 0; i < x.size(); ++i) {
-      if (i > 0) out_ << ',';
-      out_ << x[i];
-    }
+  void select_model(std::size_t n) {
+    generation_ = models_.generation();
+    instance_index_ = n;
+    instance_ = models_.get(n);
+    seed_ = instance_->seed_;
+    base_rng_ = &rngs_[n];
+    model_ = instance_->model_;
+    log_densities_ = instance_->log_densities_;
+    params_unc_.resize(get_num_unc_params());
+    grad_.resize(get_num_unc_params());
+    rho_.resize(get_num_unc_params());
+    metric_.resize(get_num_unc_params());
+    params_var_.resize(get_num_unc_params());
   }
 
   /**
-   * Write elements of the Eigen container to the output stream
-   * separated by commas.  Matrices will be dumped in column-major
-   * order.
+   * Return the names of the constrained parameters.
    *
-   * @tparam T type of container
-   * @param[in] x container
+   * @param[in] include_tp `true` to include transformed parameters
+   * @param[in] include_gq `true` to include generated quantities
+   * @return names of constrained parameters
    */
-  template <typename T>
-  void write_csv_eigen(T&& x) {
-    for (int i = 0; i < x.size(); ++i) {
-      if (i > 0) out_ << ',';
-      out_ << x(i);
-    }
+  const std::vector<std::string>& get_param_names(bool include_tp,
+                                                  bool include_gq) const {
+    return instance_->param_names_[include_tp][include_gq];
   }
 
   /**
@@ -202,13 +664,8 @@ struct repl {
    *
    * @return number of unconstrained parameters
    */
-  int get_num_unc_params() {
-    bool include_generated_quantities = false;
-    bool include_transformed_parameters = false;
-    std::vector<std::string> names;
-    model_.unconstrained_param_names(names, include_generated_quantities,
-                                     include_transformed_parameters);
-    return names.size();
+  int get_num_unc_params() const {
+    return instance_->param_unc_names_.size();
   }
 
   /**
@@ -218,265 +675,1294 @@ struct repl {
    * @return `true` if it should be called again and `false` to exit
    */
   bool read_eval_print() {
-    std::string line;
-    std::getline(in_, line);
-    std::stringstream cmd(line);
-    std::string instruction;
-    cmd >> instruction;
+    return binary_ ? read_eval_print_binary() : read_eval_print_text();
+  }
+
+  /**
+   * Read a line of input naming the instruction followed by its
+   * arguments, evaluate it, and print the result as a line of text.
+   *
+   * @return `true` if it should be called again and `false` to exit
+   */
+  bool read_eval_print_text() {
+    if (!std::getline(in_, line_))
+      return false;
+    const char* begin = line_.c_str();
+    const char* end = begin + line_.size();
+    while (begin < end && std::isspace(static_cast<unsigned char>(*begin)))
+      ++begin;
+    const char* name_end = begin;
+    while (name_end < end
+           && !std::isspace(static_cast<unsigned char>(*name_end)))
+      ++name_end;
+#ifndef STAN_MODEL_SERVER_NO_STATS
+    timer_.start();
+#endif
+    instruction_name_.assign(begin, name_end);
+    text_request_reader req(name_end, end);
+    text_response_writer res(out_);
+    return eval_print(instruction_code(instruction_name_), instruction_name_,
+                      req, res);
+  }
+
+  /**
+   * Read a binary request consisting of a header and payload,
+   * evaluate it, and write the binary response.
+   *
+   * @return `true` if it should be called again and `false` to exit
+   */
+  bool read_eval_print_binary() {
+    binary_header header;
+    if (!in_.read(reinterpret_cast<char*>(&header), sizeof(header)))
+      return false;
+#ifndef STAN_MODEL_SERVER_NO_STATS
+    timer_.start();
+#endif
+    bool result;
+    if (shm_) {
+      binary_response_writer res(out_, header.opcode, shm_->response(),
+                                 shm_->capacity());
+      if (header.length > shm_->capacity()) {
+#ifndef STAN_MODEL_SERVER_NO_STATS
+        timer_.discard();
+#endif
+        res.end_error(response_status::ERROR,
+                      "request exceeds shared memory capacity");
+        return true;
+      }
+      binary_request_reader req(header.flags, shm_->request(),
+                                header.length);
+      result = eval_print(instruction_code(header.opcode),
+                          "opcode " + std::to_string(header.opcode), req, res);
+    } else {
+      if (header.length > max_payload_) {
+#ifndef STAN_MODEL_SERVER_NO_STATS
+        timer_.discard();
+#endif
+        if (!skip_input(header.length))
+          return false;
+        binary_response_writer res(out_, header.opcode, response_payload_);
+        res.end_error(response_status::ERROR,
+                      "request payload of " + std::to_string(header.length)
+                      + " bytes exceeds maximum of "
+                      + std::to_string(max_payload_) + " bytes");
+        return true;
+      }
+      request_payload_.resize(header.length);
+      if (!in_.read(request_payload_.data(), header.length)) {
+#ifndef STAN_MODEL_SERVER_NO_STATS
+        timer_.discard();
+#endif
+        return false;
+      }
+      binary_request_reader req(header.flags, request_payload_.data(),
+                                request_payload_.size());
+      binary_response_writer res(out_, header.opcode, response_payload_);
+      result = eval_print(instruction_code(header.opcode),
+                          "opcode " + std::to_string(header.opcode), req, res);
+    }
+    if (shm_pending_) {
+      shm_ = std::move(next_shm_);
+      shm_pending_ = false;
+    }
+    return result;
+  }
+
+  /**
+   * Read and discard the specified number of bytes of input, such as
+   * the payload of a request that is too large to read, so that the
+   * next request can be read.
+   *
+   * @param[in] length number of bytes to discard
+   * @return `true` if the bytes were read and `false` if the input
+   * ended first
+   */
+  bool skip_input(std::uint64_t length) {
+    // read rather than `ignore`, which waits for a byte past the end
+    char buffer[4096];
+    while (length > 0) {
+      std::streamsize n = static_cast<std::streamsize>(
+          std::min<std::uint64_t>(length, sizeof(buffer)));
+      if (!in_.read(buffer, n))
+        return false;
+      length -= n;
+    }
+    return true;
+  }
+
+  /**
+   * Evaluate the instruction with the specified code, reading its
+   * arguments from the specified request and writing its results to
+   * the specified response, and return `true` if the REPL should
+   * continue.  Errors are reported through the response and
+   * the error stream.
+   *
+   * @param code instruction code
+   * @param instruction_name instruction as received, for error messages
+   * @param req request from which to read arguments
+   * @param res response to which to write results
+   * @return `true` if it should be called again and `false` to exit
+   */
+  bool eval_print(instruction code, const std::string& instruction_name,
+                  request_reader& req, response_writer& res) {
+    if (models_.generation() != generation_)
+      select_model(instance_index_);  // an instance has been replaced
+#ifdef STAN_MODEL_SERVER_NO_STATS
+    return eval_print_untimed(code, instruction_name, req, res);
+#else
+    timed_request_reader timed_req(req, timer_);
+    timed_response_writer timed_res(res, timer_);
+    bool result = eval_print_untimed(code, instruction_name, timed_req,
+                                     timed_res);
+    if (code == instruction::UNKNOWN) {
+      timer_.discard();
+    } else if (timer_.running()) {
+      std::uint64_t ns[NUM_PHASES];
+      timer_.stop(ns);
+      instruction_stats_[static_cast<std::uint16_t>(code)].record(ns);
+    }
+    return result;
+#endif
+  }
+
+  /**
+   * Evaluate the instruction as `eval_print` does, without recording
+   * its timing.
+   *
+   * @param code instruction code
+   * @param instruction_name instruction as received, for error messages
+   * @param req request from which to read arguments
+   * @param res response to which to write results
+   * @return `true` if it should be called again and `false` to exit
+   */
+  bool eval_print_untimed(instruction code,
+                          const std::string& instruction_name,
+                          request_reader& req, response_writer& res) {
     try {
-      if (instruction == "quit")
-	return quit();
-      if (instruction == "name")
-	return name();
-      if (instruction == "param_names")
-	return param_names(cmd);
-      if (instruction == "param_unc_names")
-	return param_unc_names();
-      if (instruction == "param_num")
-	return param_num(cmd);
-      if (instruction == "param_unc_num")
-	return param_unc_num();
-      if (instruction == "param_constrain")
-	return param_constrain(cmd);
-      if (instruction == "param_unconstrain")
-	return param_unconstrain(cmd);
-      if (instruction == "log_density")
-	return log_density(cmd);
-      out_ << "UNKNOWN" << std::endl;
-      err_ << "Unknown instruction: " << instruction << std::endl;
+      bool result = eval(code, req, res);
+      if (code != instruction::UNKNOWN) {
+        res.end();
+        return result;
+      }
+      res.end_error(response_status::UNKNOWN,
+                    "Unknown instruction: " + instruction_name);
+      err_ << "Unknown instruction: " << instruction_name << std::endl;
     } catch (const std::exception& e) {
-      out_ << "ERROR" << std::endl;
-      err_ << "Error in instruction: " << instruction << ".  "
+      res.end_error(response_status::ERROR, e.what());
+      err_ << "Error in instruction: " << instruction_name << ".  "
 	   << "Error message: " << e.what() << std::endl;
     }
     return true;
   }
 
+  /**
+   * Evaluate the instruction with the specified code and return `true`
+   * if the REPL should continue.
+   *
+   * @param code instruction code
+   * @param req request from which to read arguments
+   * @param res response to which to write results
+   * @return `true` if it should be called again and `false` to exit
+   */
+  bool eval(instruction code, request_reader& req, response_writer& res) {
+    switch (code) {
+      case instruction::QUIT:
+	return quit(res);
+      case instruction::NAME:
+	return name(res);
+      case instruction::PARAM_NAMES:
+	return param_names(req, res);
+      case instruction::PARAM_UNC_NAMES:
+	return param_unc_names(res);
+      case instruction::PARAM_NUM:
+	return param_num(req, res);
+      case instruction::PARAM_UNC_NUM:
+	return param_unc_num(res);
+      case instruction::PARAM_CONSTRAIN:
+	return param_constrain(req, res);
+      case instruction::PARAM_UNCONSTRAIN:
+	return param_unconstrain(req, res);
+      case instruction::LOG_DENSITY:
+	return log_density(req, res);
+      case instruction::LOG_DENSITY_BATCH:
+	return log_density_batch(req, res);
+      case instruction::LOG_DENSITY_HVP:
+	return log_density_hvp(req, res);
+      case instruction::SHM_ATTACH:
+	return shm_attach(req, res);
+      case instruction::STATS:
+	return stats(res);
+      case instruction::LEAPFROG:
+	return leapfrog(req, res);
+      case instruction::SAMPLE:
+	return sample(req, res);
+      case instruction::PARAM_CONSTRAIN_BATCH:
+	return param_constrain_batch(req, res);
+      case instruction::USE:
+	return use(req, res);
+      case instruction::LOAD_DATA:
+	return load_data(req, res);
+      case instruction::APPEND_DATA:
+	return append_data(req, res);
+      default:
+	return true;
+    }
+  }
+
   // REPL INSTRUCTIONS START HERE
 
   /**
-   * Print quit message to output stream and return `false`.
+   * Write quit message to the response and return `false`.
    *
+   * @param[in] res response
    * @return `false`
    */
-  bool quit() {
-    out_ << "REPL quit." << std::endl;
+  bool quit(response_writer& res) {
+    res.write_message("REPL quit.");
     return false;
   }
 
   /**
-   * Print the model name to output stream and return `true`.
+   * Write the model name to the response and return `true`.
+   *
+   * @param[in] res response
+   * @return `true`
+   */
+  bool name(response_writer& res) {
+    res.write_message(model_->model_name());
+    return true;
+  }
+
+  /**
+   * Read the number of points of a batched instruction from the
+   * request and check that the request can hold that many points of
+   * the specified number of values each, so that a bad count fails
+   * before memory is allocated for the points.
+   *
+   * @param[in] req request
+   * @param[in] num_values number of values per point
+   * @return number of points
+   * @throw std::invalid_argument if the number of points is negative
+   * or exceeds what the request can hold
+   */
+  std::int64_t read_num_points(request_reader& req, Eigen::Index num_values) {
+    std::int64_t num_points = req.read_int();
+    if (num_points < 0)
+      throw std::invalid_argument("number of points must be non-negative");
+    if (num_values > 0
+        && static_cast<std::uint64_t>(num_points)
+               > req.max_doubles() / static_cast<std::size_t>(num_values))
+      throw std::invalid_argument("number of points exceeds request size");
+    return num_points;
+  }
+
+  /**
+   * Read the rest of the request as a single string argument, without
+   * leading or trailing whitespace.
+   *
+   * @param[in] req request
+   * @return argument
+   */
+  std::string read_string_arg(request_reader& req) {
+    req.at_end();  // skip whitespace before the argument in text requests
+    std::string arg = req.read_rest();
+    while (!arg.empty()
+           && std::isspace(static_cast<unsigned char>(arg.back())))
+      arg.pop_back();
+    return arg;
+  }
+
+  /**
+   * Read the name of a model instance from the request, direct
+   * subsequent requests to it, write its number of unconstrained
+   * parameters to the response, and return `true`.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   * @throw std::domain_error if there is no instance with the name
+   */
+  bool use(request_reader& req, response_writer& res) {
+    std::string name = read_string_arg(req);
+    std::size_t n = models_.find(name);
+    if (n == models_.size())
+      throw std::domain_error("no model instance named " + name);
+    select_model(n);
+    res.write_int(get_num_unc_params());
+    return true;
+  }
+
+  /**
+   * Read a data file path or JSON data from the request, create a new
+   * instance of the current instance's model with that data and its
+   * seed, replace the current instance with it, write the number of
+   * unconstrained parameters of the new model to the response, and
+   * return `true`.  The argument is taken as JSON data if it starts
+   * with `{` and as a path otherwise, read as for the `--data` option.
+   *
+   * The current instance serves other sessions until the new one is
+   * complete, and those sessions use the new instance from their next
+   * request.  If creating the new instance fails, the current
+   * instance is kept.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   * @throw std::domain_error if there is no argument
+   * @throw std::exception if there is an error reading the data or
+   * creating the model
+   */
+  bool load_data(request_reader& req, response_writer& res) {
+    std::string arg = read_string_arg(req);
+    if (arg.empty())
+      throw std::domain_error("load_data requires a data file or JSON data");
+    std::shared_ptr<stan::io::var_context> data
+        = arg[0] == '{' ? std::make_shared<cmdstan::json::json_data>(arg)
+                        : read_data(arg);
+    std::lock_guard<std::mutex> lock(models_.update_mutex(instance_index_));
+    std::shared_ptr<model_instance> instance
+        = models_.get(instance_index_)->replacement();
+    if (arg[0] != '{')
+      instance->data_path_ = arg;
+    instance->create_model(std::move(data), &err_);
+    replace_model(std::move(instance));
+    res.write_int(get_num_unc_params());
+    return true;
+  }
+
+  /**
+   * Read JSON data from the request, copy the data of the current
+   * instance with the rows appended (see `cmdstan::json::json_data`),
+   * create a new instance of the current instance's model with the
+   * extended data and its seed, replace the current instance with
+   * it, write the number of unconstrained parameters of the new model
+   * to the response, and return `true`.
+   *
+   * Only the rows are parsed, and only the variables they extend are
+   * copied; the others are shared with the current instance's data
+   * if it was read from JSON.  Creating the new model still reads the
+   * whole data, so an append takes time linear in the size of the
+   * data.  The data of the current instance is never changed, so the
+   * current instance serves other sessions unchanged until it is
+   * replaced, and it is kept if creating the new instance fails.
+   * Appends to the same instance are serialized by its update mutex,
+   * so that none are lost.
    *
+   * @param[in] req request
+   * @param[in] res response
    * @return `true`
+   * @throw std::exception if there is an error parsing the rows,
+   * appending them, or creating the model
    */
-  bool name() {
-    out_ << model_.model_name() << std::endl;
+  bool append_data(request_reader& req, response_writer& res) {
+    cmdstan::json::json_data rows(read_string_arg(req));
+    std::lock_guard<std::mutex> lock(models_.update_mutex(instance_index_));
+    std::shared_ptr<const model_instance> current
+        = models_.get(instance_index_);
+    std::shared_ptr<model_instance> instance = current->replacement();
+    instance->create_model(
+        std::make_shared<cmdstan::json::json_data>(*current->data_, rows),
+        &err_);
+    replace_model(std::move(instance));
+    res.write_int(get_num_unc_params());
     return true;
   }
 
+  /**
+   * Replace the current instance with the specified instance and
+   * direct subsequent requests to it.
+   *
+   * @param[in] instance new instance
+   */
+  void replace_model(std::shared_ptr<const model_instance> instance) {
+    models_.replace(instance_index_, std::move(instance));
+    select_model(instance_index_);
+  }
+
   /**
    * Read whether or not to include transformed parameters and include
-   * generated quantities from the specified command stream, write
-   * the relevant constrained parameter names to the output stream,
+   * generated quantities from the specified request, write
+   * the relevant constrained parameter names to the response,
    * and return `true`.
    *
-   * @param cmd command input stream
+   * @param[in] req request
+   * @param[in] res response
    * @return `true`
    */
-  bool param_names(std::istream& cmd) {
-    bool include_transformed_parameters;
-    cmd >> include_transformed_parameters;
-    bool include_generated_quantities;
-    cmd >> include_generated_quantities;
-    std::vector<std::string> names;
-    model_.constrained_param_names(names,
-                                   include_transformed_parameters,
-                                   include_generated_quantities);
-    write_csv(names);
-    out_ << std::endl;
+  bool param_names(request_reader& req, response_writer& res) {
+    bool include_transformed_parameters = req.read_bool();
+    bool include_generated_quantities = req.read_bool();
+    res.write_strings(get_param_names(include_transformed_parameters,
+                                      include_generated_quantities));
     return true;
   }
 
   /**
-   * Write the unconstrained parameter names to the output stream and
+   * Write the unconstrained parameter names to the response and
    * return `true`.  The return excludes transformed parameters and
    * generated quantities, which do not have unconstrained forms.  .
    *
+   * @param[in] res response
    * @return `true`
    */
-  bool param_unc_names() {
-     std::vector<std::string> names;
-     constexpr static bool include_transformed_parameters = false;
-     constexpr static bool include_generated_quantities = false;
-     model_.unconstrained_param_names(names, include_transformed_parameters,
-                                      include_generated_quantities);
-     write_csv(names);
-     out_ << std::endl;
-     return true;
+  bool param_unc_names(response_writer& res) {
+    res.write_strings(instance_->param_unc_names_);
+    return true;
   }
 
   /**
    * Read whether to include transformed parameters and whether to
-   * include generated quantities from the input stream, write
-   * the relevant number of parameters to the output stream, and
+   * include generated quantities from the request, write
+   * the relevant number of parameters to the response, and
    * return `true`.
    *
-   * @param cmd command input stream
+   * @param[in] req request
+   * @param[in] res response
    * @return `false`
    */
-  bool param_num(std::istream& cmd) {
-    bool include_transformed_parameters;
-    cmd >> include_transformed_parameters;
-    bool include_generated_quantities;
-    cmd >> include_generated_quantities;
-    std::vector<std::string> names;
-    model_.constrained_param_names(names,
-                                   include_transformed_parameters,
-                                   include_generated_quantities);
-    out_ << names.size() << std::endl;
+  bool param_num(request_reader& req, response_writer& res) {
+    bool include_transformed_parameters = req.read_bool();
+    bool include_generated_quantities = req.read_bool();
+    res.write_int(get_param_names(include_transformed_parameters,
+                                  include_generated_quantities).size());
     return true;
   }
 
   /**
-   * Write the number of unconstrained parameters to the output stream
+   * Write the number of unconstrained parameters to the response
    * and return `true`.  This is just the parameters because
    * transformed parameters and generated quantities do not have
    * unconstrained forms.
    *
+   * @param[in] res response
+   * @return `true`
+   */
+  bool param_unc_num(response_writer& res) {
+    res.write_int(get_num_unc_params());
+    return true;
+  }
+
+  /**
+   * Read whether to include transformed parameters, whether to
+   * include generated quantities, the unconstrained parameters, and
+   * optionally a draw identifier from the request, then write the
+   * relevant constrained parameters to the response, and return
+   * `true`.
+   *
+   * Without a draw identifier, generated quantities use the session's
+   * pseudo-RNG, so they depend on every earlier request.  With one,
+   * they use the stream for that draw (see `draw_rng()`), so they
+   * depend only on the seed, the draw, and the parameters.
+   *
+   * @param[in] req request
+   * @param[in] res response
    * @return `true`
+   * @throw std::invalid_argument if the draw identifier is out of range
    */
-  bool param_unc_num() {
-    std::vector<std::string> names;
-    bool include_transformed_parameters = false;
-    bool include_generated_quantities = false;
-    model_.unconstrained_param_names(names,
-                                     include_transformed_parameters,
-                                     include_generated_quantities);
-    out_ << names.size() << std::endl;
+  bool param_constrain(request_reader& req, response_writer& res) {
+    bool include_transformed_parameters = req.read_bool();
+    bool include_generated_quantities = req.read_bool();
+    req.read_doubles(params_unc_.data(), params_unc_.size());
+    if (req.at_end()) {
+      model_->write_array(*base_rng_, params_unc_, params_,
+                         include_transformed_parameters,
+                         include_generated_quantities, &err_);
+    } else {
+      boost::ecuyer1988 rng = draw_rng(req.read_int());
+      model_->write_array(rng, params_unc_, params_,
+                         include_transformed_parameters,
+                         include_generated_quantities, &err_);
+    }
+    res.write_doubles(params_.data(), params_.size());
     return true;
   }
 
   /**
    * Read whether to include transformed parameters, whether to
-   * include generated quantities, and the unconstrained parameters
-   * from the intput stream, then write the relevant constrained
-   * parameters to the output stream, and return `true`.
+   * include generated quantities, the number of points, the
+   * unconstrained parameters for each point, and optionally the
+   * identifier of the first draw, then write the relevant
+   * constrained parameters of each point to the response, and
+   * return `true`.
    *
-   * @param[in] cmd command input stream
+   * The parameters are laid out point by point, so that with `N`
+   * points, `D` unconstrained parameters, and `K` constrained values
+   * they form `N x D` and `N x K` matrices in row-major order.
+   *
+   * Without a draw identifier, generated quantities use the session's
+   * pseudo-RNG and the points are constrained in order.  With one,
+   * point `n` uses the stream for draw `first + n` and points are
+   * constrained in parallel if more than one thread is available, with
+   * the same results as constraining them one at a time.
+   *
+   * @param[in] req request
+   * @param[in] res response
    * @return `true`
+   * @throw std::invalid_argument if the number of points is negative
+   * or a draw identifier is out of range
    */
-  bool param_constrain(std::istream& cmd) {
-    bool include_transformed_parameters;
-    cmd >> include_transformed_parameters;
-    bool include_generated_quantities;
-    cmd >> include_generated_quantities;
-    Eigen::VectorXd params_unc(get_num_unc_params());
-    for (int n = 0; n < params_unc.size(); ++n)
-      cmd >> params_unc(n);
-    Eigen::VectorXd params;
-    model_.write_array(base_rng_, params_unc, params,
-                       include_transformed_parameters,
-                       include_generated_quantities, &err_);
-    write_csv_eigen(params);
-    out_ << std::endl;
+  bool param_constrain_batch(request_reader& req, response_writer& res) {
+    bool include_tp = req.read_bool();
+    bool include_gq = req.read_bool();
+    std::int64_t num_points = read_num_points(req, get_num_unc_params());
+    Eigen::Index num_params = get_param_names(include_tp, include_gq).size();
+    if (num_params > 0
+        && num_points > std::numeric_limits<Eigen::Index>::max() / num_params)
+      throw std::invalid_argument("number of points too large");
+
+    Eigen::MatrixXd params_unc(get_num_unc_params(), num_points);
+    req.read_doubles(params_unc.data(), params_unc.size());
+    Eigen::MatrixXd params(num_params, num_points);
+    if (req.at_end()) {
+      Eigen::VectorXd theta(params_unc.rows());
+      Eigen::VectorXd param;
+      for (Eigen::Index n = 0; n < num_points; ++n) {
+        theta = params_unc.col(n);
+        model_->write_array(*base_rng_, theta, param, include_tp, include_gq,
+                           &err_);
+        params.col(n) = param;
+      }
+      res.write_doubles(params.data(), params.size());
+      return true;
+    }
+    std::int64_t first_draw = req.read_int();
+    if (num_points > 0) {
+      // check the range of draws before constraining any point
+      draw_rng(first_draw);
+      draw_rng(first_draw + num_points - 1);
+    }
+#ifdef STAN_THREADS
+    if (num_threads_ > 1) {
+      tbb::parallel_for(tbb::blocked_range<Eigen::Index>(0, num_points),
+          [&](const tbb::blocked_range<Eigen::Index>& r) {
+            std::stringstream msgs;
+            param_constrain_draws(include_tp, include_gq, params_unc,
+                                  first_draw, r.begin(), r.end(), params,
+                                  msgs);
+            write_messages(msgs);
+          });
+      res.write_doubles(params.data(), params.size());
+      return true;
+    }
+#endif
+    param_constrain_draws(include_tp, include_gq, params_unc, first_draw, 0,
+                          num_points, params, err_);
+    res.write_doubles(params.data(), params.size());
     return true;
   }
 
   /**
-   * Read the constrained parameters from the input stream, write the
-   * unconstrained parameters to the output stream, and return `true`.
+   * Constrain the specified range of columns of the specified matrix
+   * of unconstrained parameters, writing them into the corresponding
+   * columns of the constrained parameters.  Column `n` uses the
+   * pseudo-RNG for draw `first_draw + n`.
+   *
+   * @param[in] include_tp `true` to include transformed parameters
+   * @param[in] include_gq `true` to include generated quantities
+   * @param[in] params_unc unconstrained parameters, one point per column
+   * @param[in] first_draw identifier of draw for column 0
+   * @param[in] begin first column to constrain
+   * @param[in] end one past the last column to constrain
+   * @param[out] params constrained parameters, one point per column
+   * @param[in] msgs stream for messages from the model
+   */
+  void param_constrain_draws(bool include_tp, bool include_gq,
+                             const Eigen::MatrixXd& params_unc,
+                             std::int64_t first_draw, Eigen::Index begin,
+                             Eigen::Index end, Eigen::MatrixXd& params,
+                             std::ostream& msgs) {
+    Eigen::VectorXd theta(params_unc.rows());
+    Eigen::VectorXd param;
+    for (Eigen::Index n = begin; n < end; ++n) {
+      boost::ecuyer1988 rng = draw_rng(first_draw + n);
+      theta = params_unc.col(n);
+      model_->write_array(rng, theta, param, include_tp, include_gq, &msgs);
+      params.col(n) = param;
+    }
+  }
+
+  /**
+   * Return the pseudo-RNG for the specified draw.  Draw `n` starts
+   * `2^60 + n * 2^20` values into the stream for the server's seed,
+   * beyond the streams of the sessions and the other draws, so that
+   * generated quantities for a draw are the same whichever session
+   * or thread computes them and in whatever order.
+   *
+   * @param[in] draw identifier of draw
+   * @return pseudo-RNG for draw
+   * @throw std::invalid_argument if the draw is negative or not less
+   * than `2^39`
+   */
+  boost::ecuyer1988 draw_rng(std::int64_t draw) const {
+    if (draw < 0 || draw >= (1LL << 39))
+      throw std::invalid_argument("draw identifier out of range");
+    boost::ecuyer1988 rng(seed_);
+    rng.discard((1ULL << 60) + (static_cast<std::uint64_t>(draw) << 20));
+    return rng;
+  }
+
+  /**
+   * Read the constrained parameters from the request, write the
+   * unconstrained parameters to the response, and return `true`.
    * This only includes the parameters, not the transformed parameters
    * or generated quantities, which do not have unconstrained forms.
    *
-   * @param[in] cmd command input stream
+   * @param[in] req request
+   * @param[in] res response
    * @return `true`
    */
-  bool param_unconstrain(std::istream& cmd) {
-    std::string line;
-    std::getline(cmd, line);
-    std::stringstream in(line);
-    cmdstan::json::json_data inits_context(in);
+  bool param_unconstrain(request_reader& req, response_writer& res) {
+    cmdstan::json::json_data inits_context(req.read_rest());
     Eigen::VectorXd params_unc;
-    model_.transform_inits(inits_context, params_unc, &err_);
-    write_csv_eigen(params_unc);
-    out_ << std::endl;
+    model_->transform_inits(inits_context, params_unc, &err_);
+    res.write_doubles(params_unc.data(), params_unc.size());
     return true;
   }
 
   /**
    * Read whether to exclude constants, whether to include
    * change-of-variables adjustments, whether to include the gradient,
-   * and whether to include the Jacobian, and the unconstrained
+   * and how to compute the Hessian, and the unconstrained
    * parameters, then write the log density and gradient or Hessian if
    * specified, and return `true`.
    *
-   * The gradients are computed with automatic differentiation and the
-   * Hessian by finite differences over the autodiff gradients.
+   * The gradients are computed with automatic differentiation.  The
+   * Hessian is computed by finite differences over the autodiff
+   * gradients if the method is `HESSIAN_FINITE_DIFF` and by nested
+   * forward-over-reverse autodiff if it is `HESSIAN_AUTODIFF`.
    *
-   * @param[in] cmd command input stream
+   * @param[in] req request
+   * @param[in] res response
    * @return `true`
+   * @throw std::invalid_argument if the Hessian method is unknown
    */
-  bool log_density(std::istream& cmd) {
-    bool propto = true;
-    cmd >> propto;
-    bool jacobian = true;
-    cmd >> jacobian;
-    bool include_grad = true;
-    cmd >> include_grad;
-    bool include_hessian = true;
-    cmd >> include_hessian;
-
-    auto model_functor = create_model_functor(model_, propto, jacobian, err_);
-    Eigen::VectorXd params_unc(get_num_unc_params());
-    for (int n = 0; n < params_unc.size(); ++n)
-      cmd >> params_unc(n);
+  bool log_density(request_reader& req, response_writer& res) {
+    bool propto = req.read_bool();
+    bool jacobian = req.read_bool();
+    bool include_grad = req.read_bool();
+    int hessian_method = req.read_option(2);
+    if (hessian_method > HESSIAN_AUTODIFF)
+      throw std::invalid_argument("unknown Hessian method: "
+                                  + std::to_string(hessian_method));
+
+    auto model_functor = create_model_functor(*model_, *log_densities_,
+                                              propto, jacobian, err_);
+    req.read_doubles(params_unc_.data(), params_unc_.size());
     double log_density;
-    Eigen::VectorXd grad;
-    Eigen::MatrixXd hess;
-    if (include_hessian) {
+    if (hessian_method == HESSIAN_FINITE_DIFF) {
       stan::math::internal::finite_diff_hessian_auto(model_functor,
-          params_unc, log_density, grad, hess);
+          params_unc_, log_density, grad_, hess_);
+    } else if (hessian_method == HESSIAN_AUTODIFF) {
+#ifdef STAN_MODEL_FVAR_VAR
+      stan::math::hessian(model_functor, params_unc_, log_density, grad_,
+                          hess_);
+#else
+      throw std::domain_error("autodiff Hessians require building with"
+                              " HESSIAN_AD=true");
+#endif
     } else {
-      stan::math::gradient(model_functor, params_unc, log_density, grad);
+      eval_gradient(model_functor, params_unc_, log_density, grad_);
     }
-    out_ << log_density;
-    if (include_grad) {
-      out_ << ",";
-      write_csv_eigen(grad);
+    res.write_double(log_density);
+    if (include_grad)
+      res.write_doubles(grad_.data(), grad_.size());
+    if (hessian_method != HESSIAN_NONE)
+      res.write_doubles(hess_.data(), hess_.size());  // column major output
+    return true;
+  }
+
+  /**
+   * Read whether to exclude constants, whether to include
+   * change-of-variables adjustments, the unconstrained parameters, and
+   * a vector of the same size, then write the log density, its
+   * gradient, and the product of its Hessian and the vector, and
+   * return `true`.
+   *
+   * The log density, gradient, and Hessian-vector product all come
+   * from a single evaluation with nested forward-over-reverse autodiff
+   * (see `eval_hessian_times_vector`), without forming the Hessian.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   */
+  bool log_density_hvp(request_reader& req, response_writer& res) {
+#ifdef STAN_MODEL_FVAR_VAR
+    bool propto = req.read_bool();
+    bool jacobian = req.read_bool();
+
+    req.read_doubles(params_unc_.data(), params_unc_.size());
+    Eigen::VectorXd v(params_unc_.size());
+    req.read_doubles(v.data(), v.size());
+    auto model_functor = create_model_functor(*model_, *log_densities_,
+                                              propto, jacobian, err_);
+    double log_density;
+    Eigen::VectorXd hvp;
+    eval_hessian_times_vector(model_functor, params_unc_, v, log_density,
+                              grad_, hvp);
+    res.write_double(log_density);
+    res.write_doubles(grad_.data(), grad_.size());
+    res.write_doubles(hvp.data(), hvp.size());
+#else
+    throw std::domain_error("Hessian-vector products require building with"
+                            " HESSIAN_AD=true");
+#endif
+    return true;
+  }
+
+  /**
+   * Read whether to exclude constants, whether to include
+   * change-of-variables adjustments, the number of steps, the step
+   * size, the unconstrained parameters, the momenta, and the diagonal
+   * of the inverse metric, then run that many leapfrog steps of
+   * Hamiltonian dynamics, write the final parameters, momenta, log
+   * density, and gradient, and return `true`.
+   *
+   * Each step updates the momenta by a half step along the gradient,
+   * the parameters by a full step along the momenta scaled by the
+   * inverse metric, and the momenta by another half step.  The
+   * gradient at the end of one step is reused at the start of the
+   * next, so `L` steps take `L + 1` gradient evaluations.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   * @throw std::invalid_argument if the number of steps is negative
+   */
+  bool leapfrog(request_reader& req, response_writer& res) {
+    bool propto = req.read_bool();
+    bool jacobian = req.read_bool();
+    std::int64_t steps = req.read_int();
+    if (steps < 0)
+      throw std::invalid_argument("number of steps must be non-negative");
+    double stepsize;
+    req.read_doubles(&stepsize, 1);
+    req.read_doubles(params_unc_.data(), params_unc_.size());
+    req.read_doubles(rho_.data(), rho_.size());
+    req.read_doubles(metric_.data(), metric_.size());
+
+    auto model_functor = create_model_functor(*model_, *log_densities_,
+                                              propto, jacobian, err_);
+    double log_density;
+    eval_gradient(model_functor, params_unc_, log_density, grad_);
+    for (std::int64_t n = 0; n < steps; ++n) {
+      rho_ += 0.5 * stepsize * grad_;
+      params_unc_ += stepsize * metric_.cwiseProduct(rho_);
+      eval_gradient(model_functor, params_unc_, log_density, grad_);
+      rho_ += 0.5 * stepsize * grad_;
+    }
+    res.write_doubles(params_unc_.data(), params_unc_.size());
+    res.write_doubles(rho_.data(), rho_.size());
+    res.write_double(log_density);
+    res.write_doubles(grad_.data(), grad_.size());
+    return true;
+  }
+
+  /**
+   * Read the number of warmup iterations, the number of sampling
+   * iterations, the seed, and the number of chains, then run that
+   * many chains of Stan's adaptive NUTS sampler with a diagonal
+   * metric, streaming the column names and each draw as a part of the
+   * response as soon as it is produced.  Write the total number of
+   * draws to complete the response and return `true`.
+   *
+   * All chains share the model and its data.  If the server runs
+   * with more than one thread, chains run in parallel, each on its
+   * own thread with its own autodiff stack, and their draws are
+   * interleaved in the response; otherwise they run one after
+   * another.
+   *
+   * Each chain `k` (starting from 1) uses Stan's pseudo-RNG stream
+   * for the seed and chain `k`, so the draws of a chain do not
+   * depend on the number of threads.  The remaining sampler settings
+   * are the CmdStan defaults.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   * @throw std::invalid_argument if an argument is out of range
+   * @throw std::runtime_error if a chain fails
+   */
+  bool sample(request_reader& req, response_writer& res) {
+    std::int64_t num_warmup = req.read_int();
+    std::int64_t num_samples = req.read_int();
+    std::int64_t seed = req.read_int();
+    std::int64_t num_chains = req.read_int();
+    constexpr std::int64_t max_iterations = std::numeric_limits<int>::max();
+    if (num_warmup < 0 || num_warmup > max_iterations)
+      throw std::invalid_argument("number of warmup iterations out of range");
+    if (num_samples < 0 || num_samples > max_iterations)
+      throw std::invalid_argument("number of samples out of range");
+    if (seed < 0 || seed > std::numeric_limits<unsigned int>::max())
+      throw std::invalid_argument("seed out of range");
+    if (num_chains < 1 || num_chains > max_iterations)
+      throw std::invalid_argument("number of chains out of range");
+
+    std::mutex res_mutex;
+    bool header_written = false;
+    std::int64_t num_draws = 0;
+#ifdef STAN_THREADS
+    if (num_threads_ > 1 && num_chains > 1) {
+      // 64-bit bounds, as num_chains + 1 overflows an int at the limit
+      using chain_range = tbb::blocked_range<std::int64_t>;
+      tbb::parallel_for(chain_range(1, num_chains + 1, 1),
+          [&](const chain_range& r) {
+            for (std::int64_t chain = r.begin(); chain < r.end(); ++chain) {
+              std::stringstream msgs;
+              draw_writer writer(res, res_mutex, chain, header_written,
+                                 num_draws);
+              try {
+                run_nuts(seed, chain, num_warmup, num_samples, writer, msgs);
+              } catch (...) {
+                write_messages(msgs);
+                throw;
+              }
+              write_messages(msgs);
+            }
+          });
+      res.write_int(num_draws);
+      return true;
     }
-    if (include_hessian) {
-      out_ << ",";
-      write_csv_eigen(hess);  // column major output
+#endif
+    for (std::int64_t chain = 1; chain <= num_chains; ++chain) {
+      draw_writer writer(res, res_mutex, chain, header_written, num_draws);
+      run_nuts(seed, chain, num_warmup, num_samples, writer, err_);
     }
-    out_ << std::endl;
+    res.write_int(num_draws);
     return true;
   }
+
+  /**
+   * Run one chain of Stan's adaptive NUTS sampler with a diagonal
+   * metric, random initialization, and the CmdStan default settings,
+   * writing draws to the specified writer.
+   *
+   * @param[in] seed seed for pseudo-RNG
+   * @param[in] chain identifier of chain, which selects the stream of
+   * the pseudo-RNG
+   * @param[in] num_warmup number of warmup iterations
+   * @param[in] num_samples number of sampling iterations
+   * @param[in] sample_writer writer for draws
+   * @param[in] msgs stream for warnings and errors from the sampler
+   * @throw std::runtime_error if the sampler fails
+   */
+  void run_nuts(unsigned int seed, unsigned int chain, int num_warmup,
+                int num_samples, stan::callbacks::writer& sample_writer,
+                std::ostream& msgs) {
+    stan::io::empty_var_context init;
+    std::ostream null_stream(nullptr);
+    stan::callbacks::stream_logger logger(null_stream, null_stream, msgs,
+                                          msgs, msgs);
+    stan::callbacks::interrupt interrupt;
+    stan::callbacks::writer init_writer;
+    stan::callbacks::writer diagnostic_writer;
+    int return_code = stan::services::sample::hmc_nuts_diag_e_adapt(
+        *model_, init, seed, chain, 2.0 /* init_radius */, num_warmup,
+        num_samples, 1 /* num_thin */, false /* save_warmup */,
+        0 /* refresh */, 1.0 /* stepsize */, 0.0 /* stepsize_jitter */,
+        10 /* max_depth */, 0.8 /* delta */, 0.05 /* gamma */,
+        0.75 /* kappa */, 10.0 /* t0 */, 75 /* init_buffer */,
+        50 /* term_buffer */, 25 /* window */, interrupt, logger,
+        init_writer, sample_writer, diagnostic_writer);
+    if (return_code != 0)
+      throw std::runtime_error("sampling failed in chain "
+                               + std::to_string(chain));
+  }
+
+  /**
+   * Read whether to exclude constants, whether to include
+   * change-of-variables adjustments, the number of points, and the
+   * unconstrained parameters for each point, then write the log
+   * density of each point followed by the gradient of each point, and
+   * return `true`.
+   *
+   * The parameters and gradients are laid out point by point, so
+   * that with `N` points and `D` unconstrained parameters they form
+   * an `N x D` matrix in row-major order.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   * @throw std::invalid_argument if the number of points is negative
+   * or exceeds what the request can hold
+   */
+  bool log_density_batch(request_reader& req, response_writer& res) {
+    bool propto = req.read_bool();
+    bool jacobian = req.read_bool();
+    std::int64_t num_points = read_num_points(req, get_num_unc_params());
+
+    Eigen::MatrixXd params_unc(get_num_unc_params(), num_points);
+    req.read_doubles(params_unc.data(), params_unc.size());
+    Eigen::VectorXd log_densities(num_points);
+    Eigen::MatrixXd grads(params_unc.rows(), num_points);
+    log_density_gradients(propto, jacobian, params_unc, log_densities, grads);
+    res.write_doubles(log_densities.data(), log_densities.size());
+    res.write_doubles(grads.data(), grads.size());
+    return true;
+  }
+
+  /**
+   * Evaluate the log density and gradient at each column of the
+   * specified matrix of unconstrained parameters, writing them into
+   * the corresponding entry of the log densities and column of the
+   * gradients.  Columns are evaluated in parallel if more than one
+   * thread is available.
+   *
+   * @param[in] propto `true` if log density drops constant terms
+   * @param[in] jacobian `true` if log density includes change-of-variables
+   * terms
+   * @param[in] params_unc unconstrained parameters, one point per column
+   * @param[out] log_densities log density for each point
+   * @param[out] grads gradient for each point, one point per column
+   */
+  void log_density_gradients(bool propto, bool jacobian,
+                             const Eigen::MatrixXd& params_unc,
+                             Eigen::VectorXd& log_densities,
+                             Eigen::MatrixXd& grads) {
+#ifdef STAN_THREADS
+    if (num_threads_ > 1) {
+      tbb::parallel_for(
+          tbb::blocked_range<Eigen::Index>(0, params_unc.cols()),
+          [&](const tbb::blocked_range<Eigen::Index>& r) {
+            std::stringstream msgs;
+            log_density_gradients(propto, jacobian, params_unc,
+                                  r.begin(), r.end(),
+                                  log_densities, grads, msgs);
+            write_messages(msgs);
+          });
+      return;
+    }
+#endif
+    log_density_gradients(propto, jacobian, params_unc, 0, params_unc.cols(),
+                          log_densities, grads, err_);
+  }
+
+  /**
+   * Evaluate the log density and gradient at the specified range of
+   * columns of the specified matrix of unconstrained parameters,
+   * writing them into the corresponding entries of the log densities
+   * and columns of the gradients.
+   *
+   * @param[in] propto `true` if log density drops constant terms
+   * @param[in] jacobian `true` if log density includes change-of-variables
+   * terms
+   * @param[in] params_unc unconstrained parameters, one point per column
+   * @param[in] begin first column to evaluate
+   * @param[in] end one past the last column to evaluate
+   * @param[out] log_densities log density for each point
+   * @param[out] grads gradient for each point, one point per column
+   * @param[in] msgs stream for messages from the model
+   */
+  void log_density_gradients(bool propto, bool jacobian,
+                             const Eigen::MatrixXd& params_unc,
+                             Eigen::Index begin, Eigen::Index end,
+                             Eigen::VectorXd& log_densities,
+                             Eigen::MatrixXd& grads, std::ostream& msgs) {
+    auto model_functor = create_model_functor(*model_, *log_densities_,
+                                              propto, jacobian, msgs);
+    Eigen::VectorXd theta(params_unc.rows());
+    Eigen::VectorXd grad(params_unc.rows());
+    for (Eigen::Index n = begin; n < end; ++n) {
+      theta = params_unc.col(n);
+      stan::math::gradient(model_functor, theta, log_densities(n), grad);
+      grads.col(n) = grad;
+    }
+  }
+
+  /**
+   * Read the name of a POSIX shared-memory segment created by the
+   * client, map it, write the capacity in bytes of its request and
+   * response buffers, and return `true`.  Payloads of subsequent
+   * requests and responses are exchanged through the segment, with
+   * only their headers sent over the input and output streams.  An
+   * empty name detaches the current segment and writes zero.
+   *
+   * @param[in] req request
+   * @param[in] res response
+   * @return `true`
+   * @throw std::domain_error if not using the binary protocol
+   * @throw std::runtime_error if the segment cannot be mapped
+   */
+  bool shm_attach(request_reader& req, response_writer& res) {
+    if (!binary_)
+      throw std::domain_error("shm_attach requires the binary protocol");
+    std::string name = req.read_rest();
+    next_shm_.reset(name.empty() ? nullptr : new shared_memory(name));
+    shm_pending_ = true;
+    res.write_int(next_shm_ ? next_shm_->capacity() : 0);
+    return true;
+  }
+
+  /**
+   * Write statistics about this session as a sequence of `name=value`
+   * entries and return `true`.  The entries are the bytes held by
+   * this session's autodiff arena and, for each instruction that has
+   * been called, the number of calls and the median, 99th percentile,
+   * and maximum nanoseconds spent in each phase of handling it.
+   *
+   * @param[in] res response
+   * @return `true`
+   * @throw std::domain_error if statistics were compiled out
+   */
+  bool stats(response_writer& res) {
+#ifdef STAN_MODEL_SERVER_NO_STATS
+    throw std::domain_error("statistics require building without"
+                            " STAN_MODEL_SERVER_NO_STATS");
+#else
+    write_stat(res, "arena_bytes",
+               stan::math::ChainableStack::instance_
+               ->memalloc_.bytes_allocated());
+    for (const auto& code : instruction_codes()) {
+      const instruction_stats& s
+          = instruction_stats_[static_cast<std::uint16_t>(code.second)];
+      if (s.count() == 0)
+        continue;
+      stat_name_.assign(code.first);
+      stat_name_ += ".count";
+      write_stat(res, stat_name_.c_str(), s.count());
+      for (int p = 0; p < NUM_PHASES; ++p) {
+        const latency_histogram& h = s.phases_[p];
+        write_phase_stat(res, code.first, p, ".p50_ns", h.quantile(0.5));
+        write_phase_stat(res, code.first, p, ".p99_ns", h.quantile(0.99));
+        write_phase_stat(res, code.first, p, ".max_ns", h.max());
+      }
+    }
+    return true;
+#endif
+  }
+
+  /**
+   * Write the specified statistic of a phase of an instruction as a
+   * `name=value` entry with a name such as `log_density.eval.p50_ns`.
+   *
+   * @param[in] res response
+   * @param[in] instruction_name name of instruction
+   * @param[in] phase phase of request
+   * @param[in] suffix suffix of name of statistic
+   * @param[in] value value of statistic
+   */
+  void write_phase_stat(response_writer& res,
+                        const std::string& instruction_name, int phase,
+                        const char* suffix, std::uint64_t value) {
+    stat_name_.assign(instruction_name);
+    stat_name_ += '.';
+    stat_name_ += phase_name(phase);
+    stat_name_ += suffix;
+    write_stat(res, stat_name_.c_str(), value);
+  }
+
+  /**
+   * Append the statistics for this session to the statistics file,
+   * one `name=value` entry per line after a line identifying the
+   * session.  Sessions ending concurrently append in turn.
+   */
+  void write_stats_file() {
+    static std::mutex file_mutex;
+    std::lock_guard<std::mutex> lock(file_mutex);
+    std::ofstream file(stats_file_, std::ios::app);
+    if (!file.good()) {
+      err_ << "Cannot write statistics file: " << stats_file_ << std::endl;
+      return;
+    }
+    std::stringstream entries;
+    text_response_writer res(entries);
+    try {
+      stats(res);
+    } catch (const std::exception& e) {
+      err_ << "Cannot write statistics: " << e.what() << std::endl;
+      return;
+    }
+    std::string lines = entries.str();
+    std::replace(lines.begin(), lines.end(), ',', '\n');
+    file << "session=" << session_ << '\n' << lines << std::endl;
+  }
+
+  /**
+   * Write the specified statistic as a `name=value` entry, formatting
+   * it in a reused buffer so that reporting statistics does not itself
+   * allocate once the buffer has grown.
+   *
+   * @param[in] res response
+   * @param[in] name name of statistic
+   * @param[in] value value of statistic
+   */
+  void write_stat(response_writer& res, const char* name,
+                  std::uint64_t value) {
+    char digits[24];
+    std::snprintf(digits, sizeof(digits), "%llu",
+                  static_cast<unsigned long long>(value));
+    stat_.assign(name);
+    stat_ += '=';
+    stat_ += digits;
+    res.write_message(stat_);
+  }
+
+  /**
+   * Calculate the value and gradient of the specified functor at the
+   * specified point as `stan::math::gradient` does, but reusing this
+   * REPL's vector of autodiff variables.  Together with the autodiff
+   * arena, which retains its memory between evaluations, this avoids
+   * heap allocation by the server once the first gradient has been
+   * evaluated.
+   *
+   * @tparam F type of functor
+   * @param[in] f functor
+   * @param[in] x point at which to evaluate
+   * @param[out] fx value of functor
+   * @param[out] grad_fx gradient of functor
+   */
+  template <class F>
+  void eval_gradient(const F& f, const Eigen::VectorXd& x, double& fx,
+                     Eigen::VectorXd& grad_fx) {
+    stan::math::nested_rev_autodiff nested;
+    params_var_.resize(x.size());
+    for (Eigen::Index i = 0; i < x.size(); ++i)
+      params_var_.coeffRef(i) = x.coeff(i);
+    stan::math::var fx_var = f(params_var_);
+    fx = fx_var.val();
+    fx_var.grad();
+    grad_fx.resize(x.size());
+    for (Eigen::Index i = 0; i < x.size(); ++i)
+      grad_fx.coeffRef(i) = params_var_.coeff(i).adj();
+  }
+
+#ifdef STAN_MODEL_FVAR_VAR
+  /**
+   * Calculate the value and gradient of the specified functor and the
+   * product of its Hessian with the specified vector at the specified
+   * point, as `stan::math::hessian_times_vector` does, but from a
+   * single evaluation.  Forward mode carries the derivative along the
+   * vector through the evaluation on top of reverse mode, so that one
+   * reverse pass from the value gives the gradient and a second one
+   * from the directional derivative gives the Hessian-vector product.
+   *
+   * @tparam F type of functor
+   * @param[in] f functor
+   * @param[in] x point at which to evaluate
+   * @param[in] v vector by which to multiply the Hessian
+   * @param[out] fx value of functor
+   * @param[out] grad_fx gradient of functor
+   * @param[out] hvp product of Hessian of functor and `v`
+   */
+  template <class F>
+  void eval_hessian_times_vector(const F& f, const Eigen::VectorXd& x,
+                                 const Eigen::VectorXd& v, double& fx,
+                                 Eigen::VectorXd& grad_fx,
+                                 Eigen::VectorXd& hvp) {
+    using stan::math::fvar;
+    using stan::math::var;
+    stan::math::nested_rev_autodiff nested;
+    Eigen::Matrix<fvar<var>, Eigen::Dynamic, 1> x_fvar(x.size());
+    for (Eigen::Index i = 0; i < x.size(); ++i)
+      x_fvar.coeffRef(i) = fvar<var>{x.coeff(i), v.coeff(i)};
+    fvar<var> fx_fvar = f(x_fvar);
+    fx = fx_fvar.val_.val();
+    fx_fvar.val_.grad();
+    grad_fx.resize(x.size());
+    for (Eigen::Index i = 0; i < x.size(); ++i)
+      grad_fx.coeffRef(i) = x_fvar.coeff(i).val_.adj();
+    stan::math::set_zero_all_adjoints_nested();
+    fx_fvar.d_.grad();
+    hvp.resize(x.size());
+    for (Eigen::Index i = 0; i < x.size(); ++i)
+      hvp.coeffRef(i) = x_fvar.coeff(i).val_.adj();
+  }
+#endif
+
+  /**
+   * Write the messages in the specified stream, if any, to the error
+   * stream.  This may be called concurrently from worker threads.
+   *
+   * @param[in] msgs messages
+   */
+  void write_messages(const std::stringstream& msgs) {
+    std::string str = msgs.str();
+    if (str.empty())
+      return;
+    std::lock_guard<std::mutex> lock(err_mutex_);
+    err_ << str;
+  }
 };  // struct repl
 
 /**
  * Object managing server configuration.
  */
 struct config {
+#ifdef STAN_MODEL_SERVER_PLUGINS
+  /**
+   * Path of shared library defining the model of the default
+   * instance, or empty for no default instance.
+   */
+  std::string model_library_path_;
+#endif
+
   /**
    * Path to data file.
    */
   std::string data_file_path_;
 
+  /**
+   * Path of snapshot from which to restore data instead of reading
+   * the data file, or empty for none.
+   */
+  std::string snapshot_in_path_;
+
+  /**
+   * Path of snapshot to which to write the loaded data, or empty for
+   * none.
+   */
+  std::string snapshot_out_path_;
+
   /**
    * Random seed used to construct server.
    */
   unsigned int seed_;
 
   /**
-   * Pointer to Stan model of base class.
+   * Specifications of model instances in addition to the default
+   * instance given by the data and seed options (see `parse_instance`).
    */
-  stan::model::model_base* model_;
+  std::vector<std::string> instance_specs_;
+
+  /**
+   * Protocol for requests and responses, either `text` or `binary`.
+   */
+  std::string protocol_;
+
+  /**
+   * Number of threads used to parse JSON data, evaluate batched
+   * instructions, and run sampler chains.
+   */
+  int threads_;
+
+  /**
+   * Address on which to listen for connections, or empty to serve
+   * standard input and output.
+   */
+  std::string listen_;
 
   /**
-   * Construct model based on command-line arguments.  Holds a pointer
-   * to the Stan model class and manages its resources following the
-   * RAII pattern (allocate resources in constructor, free in
-   * destructor).
+   * Path of file to which to append statistics when a session ends,
+   * or empty for none.
+   */
+  std::string stats_file_;
+
+  /**
+   * Maximum bytes of a binary request payload sent over the stream.
+   */
+  std::uint64_t max_payload_;
+
+  /**
+   * Model instances, the default instance first if there is one.
+   * Sessions start with the first instance.
+   */
+  model_registry models_;
+
+  /**
+   * Construct the model instances based on command-line arguments.
+   * The instances hold the Stan models and manage their resources
+   * following the RAII pattern (allocate resources in constructor,
+   * free in destructor).
    *
    * @param[in] argc number of command-line arguments (including executable)
    * @param[in] argv command-line arguments in C string format
@@ -484,61 +1970,369 @@ struct config {
    * specified file
    */
   config(int argc, const char* argv[]) :
-      data_file_path_(), seed_(1234) {
+#ifdef STAN_MODEL_SERVER_PLUGINS
+      model_library_path_(),
+#endif
+      data_file_path_(), snapshot_in_path_(), snapshot_out_path_(),
+      seed_(1234), instance_specs_(), protocol_("text"), threads_(1),
+      listen_(), stats_file_(), max_payload_(DEFAULT_MAX_PAYLOAD),
+      models_() {
     parse(argc, argv);
-    create_model();
+    stan::math::init_threadpool_tbb(threads_);
+    create_models();
   }
 
   /**
-   * Free the model's memory.
-   */
-  ~config() { delete model_; }
-
-  /**
-   * Parse the command-line arguments and set the data file path and
-   * seed for this class.
+   * Parse the command-line arguments and set the model library path
+   * (for servers built with `STAN_MODEL_SERVER_PLUGINS`), data file
+   * path, snapshot paths, seed, instance specifications, protocol,
+   * number of threads, listen address, statistics file, and maximum
+   * payload size for this class.
    *
    * @param[in] argc number of command-line arguments (including executable)
    * @param[in] argv command-line arguments in C string format
    */
   int parse(int argc, const char* argv[]) {
     CLI::App app{"Stan Command Line Interface"};
-    app.add_option("-d, --data", data_file_path_,
-                   "File containing data in JSON", true)
+#ifdef STAN_MODEL_SERVER_PLUGINS
+    app.add_option("-m, --model", model_library_path_,
+                   "Shared library defining the model")
         -> check(CLI::ExistingFile);
+#endif
+    auto data_option
+        = app.add_option("-d, --data", data_file_path_,
+                         "File containing data in JSON or binary data format",
+                         true)
+          -> check(CLI::ExistingFile);
+    app.add_option("--snapshot-in", snapshot_in_path_,
+                   "Snapshot file from which to restore data instead of"
+                   " a data file")
+        -> check(CLI::ExistingFile)
+        -> excludes(data_option);
+    app.add_option("--snapshot-out", snapshot_out_path_,
+                   "Snapshot file to which to write data once loaded");
     app.add_option("-s, --seed", seed_,
                    "Random seed", true)
         -> check(CLI::PositiveNumber);
+    app.add_option("-i, --instance", instance_specs_,
+                   "Further model instance as name=<name>[,data=<path>]"
+                   "[,seed=<seed>]"
+#ifdef STAN_MODEL_SERVER_PLUGINS
+                   ",model=<path>"
+#endif
+                   );
+    app.add_option("--protocol", protocol_,
+                   "Protocol for requests and responses (text or binary)",
+                   true)
+        -> check(CLI::IsMember({"text", "binary"}));
+    app.add_option("-t, --threads", threads_,
+                   "Number of threads for batched instructions and chains",
+                   true)
+        -> check(CLI::PositiveNumber);
+    app.add_option("-l, --listen", listen_,
+                   "Serve connections on unix:<path> or tcp:[<host>:]<port>"
+                   " instead of standard input and output");
+    app.add_option("--stats-file", stats_file_,
+                   "File to which to append statistics when a session ends");
+    app.add_option("--max-payload", max_payload_,
+                   "Maximum bytes of a binary request payload sent over"
+                   " the stream", true)
+        -> check(CLI::PositiveNumber);
     CLI11_PARSE(app, argc, argv);
+    if (protocol_ == "binary" && !is_little_endian())
+      throw std::runtime_error("Binary protocol requires little-endian host");
+#ifndef STAN_THREADS
+    if (threads_ > 1)
+      throw std::runtime_error("Multiple threads require building with"
+                               " STAN_THREADS=true");
+#endif
     return 0;
   }
 
   /**
-   * Allocate model and initialize data and transformed data.  Use the
-   * JSON-formatted data at the data file path, or an empty context if
+   * Return a model instance without a model from the specified
+   * specification, which is a comma-separated list of `key=value`
+   * entries.  The `name` entry is required; the `data` entry gives
+   * the path of a data file, as for the `--data` option; and the
+   * `seed` entry gives the random seed, which defaults to the seed of
+   * the server.  Servers built with `STAN_MODEL_SERVER_PLUGINS`
+   * require a `model` entry giving the path of the model library.
+   *
+   * @param[in] spec specification of instance
+   * @return model instance
+   * @throw std::runtime_error if the specification is malformed
+   */
+  std::shared_ptr<model_instance> parse_instance(const std::string& spec)
+      const {
+    std::shared_ptr<model_instance> instance
+        = std::make_shared<model_instance>("", seed_);
+    std::stringstream entries(spec);
+    std::string entry;
+    while (std::getline(entries, entry, ',')) {
+      std::size_t eq = entry.find('=');
+      std::string key = entry.substr(0, eq);
+      std::string value = eq == std::string::npos ? "" : entry.substr(eq + 1);
+      std::stringstream value_in(value);
+      if (key == "name" && !value.empty()) {
+        instance->name_ = value;
+      } else if (key == "data" && !value.empty()) {
+        instance->data_path_ = value;
+      } else if (key == "seed" && (value_in >> instance->seed_)
+                 && value_in.eof()) {
+#ifdef STAN_MODEL_SERVER_PLUGINS
+      } else if (key == "model" && !value.empty()) {
+        instance->library_path_ = value;
+#endif
+      } else {
+        throw std::runtime_error("Bad entry in instance specification: "
+                                 + entry);
+      }
+    }
+    if (instance->name_.empty())
+      throw std::runtime_error("Instance specification without name: "
+                               + spec);
+#ifdef STAN_MODEL_SERVER_PLUGINS
+    if (instance->library_path_.empty())
+      throw std::runtime_error("Instance specification without model: "
+                               + spec);
+#endif
+    return instance;
+  }
+
+  /**
+   * Create the model instances: the default instance, named
+   * `default`, from the data and seed options, unless a server built
+   * with `STAN_MODEL_SERVER_PLUGINS` is given no model library, and
+   * then an instance for each instance specification.
+   *
+   * @throw std::runtime_error if there are no instances, if instance
+   * names repeat, or if there is an error creating an instance
+   */
+  void create_models() {
+#ifdef STAN_MODEL_SERVER_PLUGINS
+    bool has_default = model_library_path_ != "";
+    if (!has_default && (data_file_path_ != "" || snapshot_in_path_ != ""
+                         || snapshot_out_path_ != ""))
+      throw std::runtime_error("Data and snapshot options require --model");
+#else
+    bool has_default = true;
+#endif
+    if (has_default) {
+      std::shared_ptr<model_instance> instance
+          = std::make_shared<model_instance>("default", seed_);
+#ifdef STAN_MODEL_SERVER_PLUGINS
+      instance->library_path_ = model_library_path_;
+#endif
+      instance->data_path_ = data_file_path_;
+      create_model(*instance, snapshot_in_path_, snapshot_out_path_);
+      models_.add(std::move(instance));
+    }
+    for (const std::string& spec : instance_specs_) {
+      std::shared_ptr<model_instance> instance = parse_instance(spec);
+      if (models_.find(instance->name_) != models_.size())
+        throw std::runtime_error("Repeated instance name: "
+                                 + instance->name_);
+      create_model(*instance, "", "");
+      models_.add(std::move(instance));
+    }
+    if (models_.size() == 0)
+      throw std::runtime_error("No model given; use --model or --instance");
+  }
+
+  /**
+   * Allocate the model of the specified instance and initialize its
+   * data and transformed data, loading the model library first for
+   * servers built with `STAN_MODEL_SERVER_PLUGINS`.  Use the data of
+   * the snapshot if one was given, or else the data at the instance's
+   * data file path, which is memory mapped if it is in the binary
+   * data format and parsed as JSON otherwise, or an empty context if
    * no path was given.
    *
+   * @param[in, out] instance model instance
+   * @param[in] snapshot_in_path path of snapshot from which to restore
+   * data, or empty for none
+   * @param[in] snapshot_out_path path of snapshot to which to write
+   * data, or empty for none
    * @throw std::runtime_error if there is an error reading the file
+   * or writing the snapshot
    */
-  void create_model() {
-    if (data_file_path_ == "") {
-      stan::io::empty_var_context empty_data;
-      model_ = &new_model(empty_data, seed_, &std::cerr);
+  void create_model(model_instance& instance,
+                    const std::string& snapshot_in_path,
+                    const std::string& snapshot_out_path) {
+#ifdef STAN_MODEL_SERVER_PLUGINS
+    instance.library_.reset(new model_library(instance.library_path_));
+#endif
+    if (snapshot_in_path != "") {
+      if (!is_binary_data(snapshot_in_path))
+        throw std::runtime_error("Not a snapshot file: " + snapshot_in_path);
+      create_model(instance, std::make_shared<binary_data>(snapshot_in_path),
+                   snapshot_out_path);
       return;
     }
-    std::ifstream in(data_file_path_);
-    if (!in.good())
-      throw std::runtime_error("Cannot read input file: " + data_file_path_);
-    cmdstan::json::json_data data(in);
-    in.close();
-    model_ = &new_model(data, seed_, &std::cerr);
+    create_model(instance, read_data(instance.data_path_), snapshot_out_path);
+  }
+
+  /**
+   * Allocate the model of the specified instance with the specified
+   * data, cache its parameter names, then write the data to the
+   * snapshot path if one was given.  The snapshot is written to a
+   * temporary file that is renamed once complete, so that servers
+   * starting concurrently never map a partial snapshot.
+   *
+   * @param[in, out] instance model instance
+   * @param[in] data data for model
+   * @param[in] snapshot_out_path path of snapshot to which to write
+   * data, or empty for none
+   * @throw std::runtime_error if there is an error writing the snapshot
+   */
+  void create_model(model_instance& instance,
+                    std::shared_ptr<stan::io::var_context> data,
+                    const std::string& snapshot_out_path) {
+    instance.create_model(data, &std::cerr);
+    if (snapshot_out_path == "")
+      return;
+    std::string tmp_path = snapshot_out_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out.good())
+      throw std::runtime_error("Cannot write snapshot file: " + tmp_path);
+    write_binary_data(*data, out);
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), snapshot_out_path.c_str()))
+      throw std::runtime_error("Cannot write snapshot file: "
+                               + snapshot_out_path);
+  }
+};
+
+
+/**
+ * Run a REPL session over the specified connected descriptor until
+ * the client quits or disconnects, then close the descriptor.  Errors
+ * are reported to standard error without stopping the server.
+ *
+ * @param[in] cfg server configuration holding the model instances
+ * @param[in] fd connected file descriptor
+ * @param[in] session identifier of session
+ * @param[in] err_mutex mutex guarding standard error
+ */
+void serve_session(config& cfg, int fd, unsigned int session,
+                   std::mutex& err_mutex) {
+#ifdef STAN_THREADS
+  stan::math::ChainableStack ad_stack;  // autodiff stack for this thread
+#endif
+  locked_streambuf err_buf(std::cerr, err_mutex);
+  std::ostream err(&err_buf);
+  try {
+    fd_streambuf buf(fd);
+    std::istream in(&buf);
+    std::ostream out(&buf);
+    repl r(cfg.models_, in, out, err, cfg.protocol_ == "binary",
+           cfg.threads_, session, cfg.stats_file_, cfg.max_payload_);
+    r.loop();
+  } catch (const std::exception& e) {
+    err << "ERROR: Session " << session << " failed: " << e.what()
+        << std::endl;
+  }
+}
+
+#ifdef STAN_THREADS
+/**
+ * Threads running REPL sessions.  Finished threads are joined as new
+ * sessions start and the remaining ones when this object is
+ * destroyed, so that no session outlives the configuration and
+ * streams it refers to.
+ */
+class session_threads {
+  /**
+   * Thread and flag set once its session has ended.
+   */
+  struct session_thread {
+    std::thread thread_;
+    std::shared_ptr<std::atomic<bool>> done_;
+  };
+
+  /**
+   * Threads of the sessions not yet joined.
+   */
+  std::list<session_thread> threads_;
+
+ public:
+  session_threads() = default;
+  session_threads(const session_threads&) = delete;
+  session_threads& operator=(const session_threads&) = delete;
+
+  /**
+   * Join the threads of all sessions, waiting for them to end.
+   */
+  ~session_threads() {
+    for (auto& t : threads_)
+      t.thread_.join();
+  }
+
+  /**
+   * Join the threads of the sessions that have ended, then run the
+   * specified function on a new thread.
+   *
+   * @tparam F type of function
+   * @param[in] f function running a session
+   */
+  template <class F>
+  void start(F f) {
+    for (auto it = threads_.begin(); it != threads_.end(); ) {
+      if (*it->done_) {
+        it->thread_.join();
+        it = threads_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    auto done = std::make_shared<std::atomic<bool>>(false);
+    threads_.push_back({std::thread([f, done]() {
+      f();
+      *done = true;
+    }), done});
   }
 };
+#endif
 
+/**
+ * Listen for connections on the configured address and serve each
+ * with its own REPL session sharing the model instances.  Each
+ * session gets its own stream of the pseudo-RNG of each instance.  If
+ * the server is built with `STAN_THREADS`, sessions run concurrently
+ * on their own threads, which are joined before this function
+ * returns.  Otherwise they are served one after another, so a
+ * connected client blocks all others until it disconnects, even
+ * while idle.  This function only returns by throwing an exception.
+ *
+ * @param[in] cfg server configuration
+ * @throw std::runtime_error if the address cannot be listened on
+ */
+void serve_connections(config& cfg) {
+  std::signal(SIGPIPE, SIG_IGN);  // report closed connections as errors
+  std::mutex err_mutex;
+  listener server(cfg.listen_);
+#ifdef STAN_THREADS
+  session_threads sessions;
+#endif
+  for (unsigned int session = 0; ; ++session) {
+    int fd = server.accept();
+#ifdef STAN_THREADS
+    sessions.start([&cfg, fd, session, &err_mutex]() {
+      serve_session(cfg, fd, session, err_mutex);
+    });
+#else
+    serve_session(cfg, fd, session, err_mutex);
+#endif
+  }
+}
 
+#ifndef STAN_MODEL_SERVER_NO_MAIN
 /**
  * Setup the server based on the command-line arguments and run its
- * REPL loop until clean exit or exceptional exit.
+ * REPL loop until clean exit or exceptional exit.  If a listen address
+ * is configured, serve connections on it instead of standard input
+ * and output.  Test programs that include this file to drive a REPL
+ * directly define `STAN_MODEL_SERVER_NO_MAIN` to leave it out.
  *
  * @param[in] argc number of command-line arguments (including executable)
  * @param[in] argv command-line arguments in C string format
@@ -551,7 +2345,13 @@ int main(int argc, const char* argv[]) {
   try {
     un_synch_un_autoflush_std_io_for_speed();
     config cfg(argc, argv);
-    repl r(*cfg.model_, cfg.seed_, std::cin, std::cout, std::cerr);
+    if (!cfg.listen_.empty()) {
+      serve_connections(cfg);
+      return SUCCESS_RC;
+    }
+    repl r(cfg.models_, std::cin, std::cout, std::cerr,
+           cfg.protocol_ == "binary", cfg.threads_, 0, cfg.stats_file_,
+           cfg.max_payload_);
     r.loop();
     return SUCCESS_RC;
   } catch (const std::exception& e) {
@@ -564,3 +2364,4 @@ int main(int argc, const char* argv[]) {
     return UNKNOWN_EXCEPT_RC;
   }
 }
+#endif
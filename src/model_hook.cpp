@@ -0,0 +1,26 @@
+// Compiled with the code generated for a Stan program included first
+// (see the makefile), which defines `stan_model` as its model class.
+#include <server/log_density_table.hpp>
+#include <server/model_abi.hpp>
+
+const log_density_table& model_log_density_table() {
+  static const log_density_table table = make_log_density_table<stan_model>();
+  return table;
+}
+
+// Entry points looked up by name when the model is compiled as a shared
+// library and loaded by a server built to load models (see
+// `model_library`).
+
+extern "C" const model_abi stan_model_server_abi
+    = {MODEL_ABI_VERSION, model_abi_flags()};
+
+extern "C" stan::model::model_base* stan_model_server_new_model(
+    stan::io::var_context& data_context, unsigned int seed,
+    std::ostream* msg_stream) {
+  return &new_model(data_context, seed, msg_stream);
+}
+
+extern "C" const log_density_table* stan_model_server_log_density_table() {
+  return &model_log_density_table();
+}
@@ -0,0 +1,446 @@
+#ifndef SERVER_BINARY_DATA_HPP
+#define SERVER_BINARY_DATA_HPP
+
+#include <server/protocol.hpp>
+#include <stan/io/var_context.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Layout of binary data files.  All values are little endian.  A file
+ * starts with the 8-byte magic string `STANDAT1` and the number of
+ * variables as a uint64, followed by one entry per variable:
+ *
+ * | bytes  | type        | field                                   |
+ * |--------|-------------|-----------------------------------------|
+ * | 0-3    | uint32      | length of name in bytes                 |
+ * | 4-7    | uint32      | type: 0 for float64 values, 1 for int32 |
+ * | 8-11   | uint32      | number of dimensions `N`                |
+ * | 12-15  | uint32      | reserved (zero)                         |
+ * | 16-23  | uint64      | offset of values from start of file     |
+ * | 24-    | uint64[N]   | dimensions                              |
+ * |        | char[]      | name, zero-padded to a multiple of 8    |
+ *
+ * The values of each variable are stored contiguously in column-major
+ * order, as in a `var_context`, starting at an offset that is a
+ * multiple of 8.
+ */
+namespace binary_data_format {
+
+/** Magic string at the start of every binary data file */
+static constexpr char MAGIC[8] = {'S', 'T', 'A', 'N', 'D', 'A', 'T', '1'};
+
+/** Type code of variables with double-precision values */
+static constexpr std::uint32_t TYPE_REAL = 0;
+
+/** Type code of variables with integer values */
+static constexpr std::uint32_t TYPE_INT = 1;
+
+/**
+ * Fixed-size part of the entry for a variable.
+ */
+struct entry_header {
+  /** Length of name in bytes */
+  std::uint32_t name_length;
+
+  /** Type of values, either `TYPE_REAL` or `TYPE_INT` */
+  std::uint32_t type;
+
+  /** Number of dimensions */
+  std::uint32_t num_dims;
+
+  /** Reserved for future use; must be zero */
+  std::uint32_t reserved;
+
+  /** Offset of the values from the start of the file */
+  std::uint64_t offset;
+};
+
+static_assert(sizeof(entry_header) == 24,
+              "entry_header must be packed into 24 bytes");
+
+/**
+ * Return the specified size rounded up to a multiple of 8.
+ *
+ * @param n size in bytes
+ * @return padded size in bytes
+ */
+inline std::uint64_t pad8(std::uint64_t n) { return (n + 7) & ~7ULL; }
+
+}  // namespace binary_data_format
+
+/**
+ * Return `true` if the file at the specified path starts with the
+ * magic string of a binary data file.
+ *
+ * @param path path of file
+ * @return `true` if the file is binary data
+ */
+inline bool is_binary_data(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(binary_data_format::MAGIC)];
+  return in.read(magic, sizeof(magic))
+         && std::memcmp(magic, binary_data_format::MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * A `binary_data` is a `var_context` reading variables from a memory
+ * mapped binary data file (see `binary_data_format`).  Only the
+ * header is parsed when the file is opened; the values of a variable
+ * are copied out of the mapping when the model asks for them, so
+ * loading large data takes little more memory than the model's own
+ * copy.  Integer variables may also be read as real values.
+ */
+class binary_data : public stan::io::var_context {
+ private:
+  /**
+   * Location and shape of the values of a variable in the mapping.
+   */
+  struct variable {
+    std::uint32_t type;
+    std::vector<std::size_t> dims;
+    const char* data;
+    std::size_t size;
+  };
+
+  const char* data_;
+  std::size_t length_;
+  std::unordered_map<std::string, variable> vars_;
+
+  /**
+   * Return the variable with the specified name, or `nullptr` if
+   * there is none.
+   *
+   * @param name name of variable
+   * @return pointer to variable or `nullptr`
+   */
+  const variable* find(const std::string& name) const {
+    auto it = vars_.find(name);
+    return it == vars_.end() ? nullptr : &it->second;
+  }
+
+  /**
+   * Throw an exception reporting that the file is malformed.
+   *
+   * @param msg description of the problem
+   * @throw std::runtime_error always
+   */
+  [[noreturn]] static void malformed(const std::string& msg) {
+    throw std::runtime_error("Malformed binary data: " + msg);
+  }
+
+  /**
+   * Parse the header of the mapped file and index its variables.
+   *
+   * @throw std::runtime_error if the header is malformed or a
+   * variable's values lie outside the file
+   */
+  void parse_header() {
+    using namespace binary_data_format;
+    std::uint64_t num_vars;
+    if (length_ < sizeof(MAGIC) + sizeof(num_vars)
+        || std::memcmp(data_, MAGIC, sizeof(MAGIC)) != 0)
+      malformed("missing magic string");
+    std::memcpy(&num_vars, data_ + sizeof(MAGIC), sizeof(num_vars));
+    std::uint64_t pos = sizeof(MAGIC) + sizeof(num_vars);
+    for (std::uint64_t n = 0; n < num_vars; ++n) {
+      entry_header entry;
+      if (length_ - pos < sizeof(entry))
+        malformed("truncated header");
+      std::memcpy(&entry, data_ + pos, sizeof(entry));
+      pos += sizeof(entry);
+      if (entry.type != TYPE_REAL && entry.type != TYPE_INT)
+        malformed("unknown type " + std::to_string(entry.type));
+      if ((length_ - pos) / sizeof(std::uint64_t) < entry.num_dims)
+        malformed("truncated header");
+      variable var;
+      var.type = entry.type;
+      var.size = 1;
+      var.dims.resize(entry.num_dims);
+      for (std::uint32_t d = 0; d < entry.num_dims; ++d) {
+        std::uint64_t dim;
+        std::memcpy(&dim, data_ + pos, sizeof(dim));
+        pos += sizeof(dim);
+        if (dim != 0 && var.size > length_ / dim)
+          malformed("variable larger than file");
+        var.dims[d] = dim;
+        var.size *= dim;
+      }
+      if (length_ - pos < pad8(entry.name_length))
+        malformed("truncated header");
+      std::string name(data_ + pos, entry.name_length);
+      pos += pad8(entry.name_length);
+      std::size_t bytes = var.size * (entry.type == TYPE_REAL
+                                      ? sizeof(double) : sizeof(std::int32_t));
+      if (entry.offset % 8 != 0 || entry.offset > length_
+          || length_ - entry.offset < bytes)
+        malformed("values of " + name + " outside file");
+      var.data = data_ + entry.offset;
+      if (!vars_.emplace(std::move(name), std::move(var)).second)
+        malformed("duplicate variable");
+    }
+  }
+
+ public:
+  /**
+   * Map the binary data file at the specified path and index its
+   * variables.
+   *
+   * @param path path of file
+   * @throw std::runtime_error if the file cannot be read or mapped or
+   * is malformed
+   */
+  explicit binary_data(const std::string& path)
+      : data_(nullptr), length_(0) {
+    if (!is_little_endian())
+      throw std::runtime_error("Binary data requires little-endian host");
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Cannot open binary data " + path + ": "
+                               + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || st.st_size == 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot size binary data " + path);
+    }
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Cannot map binary data " + path + ": "
+                               + std::strerror(errno));
+    data_ = static_cast<const char*>(data);
+    length_ = st.st_size;
+    try {
+      parse_header();
+    } catch (...) {
+      ::munmap(const_cast<char*>(data_), length_);
+      throw;
+    }
+  }
+
+  /**
+   * Unmap the file.
+   */
+  ~binary_data() { ::munmap(const_cast<char*>(data_), length_); }
+
+  binary_data(const binary_data&) = delete;
+  binary_data& operator=(const binary_data&) = delete;
+
+  bool contains_r(const std::string& name) const {
+    return find(name) != nullptr;
+  }
+
+  bool contains_i(const std::string& name) const {
+    const variable* var = find(name);
+    return var != nullptr && var->type == binary_data_format::TYPE_INT;
+  }
+
+  std::vector<double> vals_r(const std::string& name) const {
+    const variable* var = find(name);
+    if (var == nullptr)
+      return std::vector<double>();
+    std::vector<double> vals(var->size);
+    if (var->type == binary_data_format::TYPE_REAL) {
+      std::memcpy(vals.data(), var->data, var->size * sizeof(double));
+    } else {
+      for (std::size_t i = 0; i < var->size; ++i) {
+        std::int32_t n;
+        std::memcpy(&n, var->data + i * sizeof(n), sizeof(n));
+        vals[i] = n;
+      }
+    }
+    return vals;
+  }
+
+  /**
+   * Return the complex values of the variable with the specified
+   * name, whose last dimension of size 2 holds the real and imaginary
+   * parts.
+   *
+   * @param name name of variable
+   * @return complex values of variable
+   */
+  std::vector<std::complex<double>> vals_c(const std::string& name) const {
+    const variable* var = find(name);
+    if (var == nullptr || var->size == 0 || var->dims.empty())
+      return std::vector<std::complex<double>>();
+    std::vector<double> vals = vals_r(name);
+    std::size_t offset = vals.size() / var->dims.back();
+    std::vector<std::complex<double>> vals_c(vals.size() / 2);
+    for (std::size_t i = 0; i < vals_c.size(); ++i)
+      vals_c[i] = std::complex<double>(vals[i], vals[i + offset]);
+    return vals_c;
+  }
+
+  std::vector<std::size_t> dims_r(const std::string& name) const {
+    const variable* var = find(name);
+    return var == nullptr ? std::vector<std::size_t>() : var->dims;
+  }
+
+  std::vector<int> vals_i(const std::string& name) const {
+    if (!contains_i(name))
+      return std::vector<int>();
+    const variable* var = find(name);
+    std::vector<int> vals(var->size);
+    for (std::size_t i = 0; i < var->size; ++i) {
+      std::int32_t n;
+      std::memcpy(&n, var->data + i * sizeof(n), sizeof(n));
+      vals[i] = n;
+    }
+    return vals;
+  }
+
+  std::vector<std::size_t> dims_i(const std::string& name) const {
+    return contains_i(name) ? find(name)->dims : std::vector<std::size_t>();
+  }
+
+  /**
+   * Write the names of the variables with real values, excluding
+   * those with integer values, into the specified vector.
+   *
+   * @param[out] names names of variables
+   */
+  void names_r(std::vector<std::string>& names) const {
+    names.clear();
+    for (const auto& var : vars_)
+      if (var.second.type == binary_data_format::TYPE_REAL)
+        names.push_back(var.first);
+  }
+
+  /**
+   * Write the names of the variables with integer values into the
+   * specified vector.
+   *
+   * @param[out] names names of variables
+   */
+  void names_i(std::vector<std::string>& names) const {
+    names.clear();
+    for (const auto& var : vars_)
+      if (var.second.type == binary_data_format::TYPE_INT)
+        names.push_back(var.first);
+  }
+
+  void validate_dims(const std::string& stage, const std::string& name,
+                     const std::string& base_type,
+                     const std::vector<std::size_t>& dims_declared) const {
+    const variable* var = find(name);
+    if (var == nullptr || (base_type == "int" && !contains_i(name))) {
+      std::stringstream msg;
+      msg << (var != nullptr ? "int variable contained non-int values"
+                             : "variable does not exist")
+          << "; processing stage=" << stage << "; variable name=" << name
+          << "; base type=" << base_type;
+      throw std::runtime_error(msg.str());
+    }
+    std::size_t num_elements_expected = 1;
+    for (std::size_t dim : dims_declared)
+      num_elements_expected *= dim;
+    if (var->size == 0 && num_elements_expected == 0)
+      return;
+    if (var->dims != dims_declared) {
+      std::stringstream msg;
+      msg << "mismatch in dimensions declared and found in context"
+          << "; processing stage=" << stage << "; variable name=" << name
+          << "; dims declared=";
+      dims_msg(msg, dims_declared);
+      msg << "; dims found=";
+      dims_msg(msg, var->dims);
+      throw std::runtime_error(msg.str());
+    }
+  }
+};
+
+/**
+ * Write the variables of the specified context to the specified
+ * stream in the binary data format.  Variables with integer values
+ * are written as integers and all others as doubles.
+ *
+ * @param[in] context variables to write
+ * @param[in] out stream to which to write
+ * @throw std::runtime_error if the host is not little endian or the
+ * stream fails
+ */
+inline void write_binary_data(const stan::io::var_context& context,
+                              std::ostream& out) {
+  using namespace binary_data_format;
+  if (!is_little_endian())
+    throw std::runtime_error("Binary data requires little-endian host");
+  std::vector<std::string> names;
+  std::vector<std::string> names_i;
+  context.names_r(names);
+  context.names_i(names_i);
+  for (const std::string& name : names_i)
+    if (std::find(names.begin(), names.end(), name) == names.end())
+      names.push_back(name);
+
+  std::uint64_t num_vars = names.size();
+  std::vector<entry_header> entries(num_vars);
+  std::vector<std::vector<std::size_t>> dims(num_vars);
+  std::uint64_t header_size = sizeof(MAGIC) + sizeof(num_vars);
+  for (std::size_t n = 0; n < num_vars; ++n) {
+    bool is_int = context.contains_i(names[n]);
+    dims[n] = is_int ? context.dims_i(names[n]) : context.dims_r(names[n]);
+    entries[n].name_length = names[n].size();
+    entries[n].type = is_int ? TYPE_INT : TYPE_REAL;
+    entries[n].num_dims = dims[n].size();
+    entries[n].reserved = 0;
+    header_size += sizeof(entry_header)
+                   + dims[n].size() * sizeof(std::uint64_t)
+                   + pad8(names[n].size());
+  }
+  std::uint64_t offset = header_size;
+  for (std::size_t n = 0; n < num_vars; ++n) {
+    std::uint64_t size = 1;
+    for (std::size_t dim : dims[n])
+      size *= dim;
+    entries[n].offset = offset;
+    offset += pad8(size * (entries[n].type == TYPE_INT
+                           ? sizeof(std::int32_t) : sizeof(double)));
+  }
+
+  const char padding[8] = {0};
+  out.write(MAGIC, sizeof(MAGIC));
+  out.write(reinterpret_cast<const char*>(&num_vars), sizeof(num_vars));
+  for (std::size_t n = 0; n < num_vars; ++n) {
+    out.write(reinterpret_cast<const char*>(&entries[n]), sizeof(entries[n]));
+    for (std::uint64_t dim : dims[n])
+      out.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+    out.write(names[n].data(), names[n].size());
+    out.write(padding, pad8(names[n].size()) - names[n].size());
+  }
+  for (std::size_t n = 0; n < num_vars; ++n) {
+    std::size_t bytes;
+    if (entries[n].type == TYPE_INT) {
+      std::vector<int> vals = context.vals_i(names[n]);
+      std::vector<std::int32_t> vals32(vals.begin(), vals.end());
+      bytes = vals32.size() * sizeof(std::int32_t);
+      out.write(reinterpret_cast<const char*>(vals32.data()), bytes);
+    } else {
+      std::vector<double> vals = context.vals_r(names[n]);
+      bytes = vals.size() * sizeof(double);
+      out.write(reinterpret_cast<const char*>(vals.data()), bytes);
+    }
+    out.write(padding, pad8(bytes) - bytes);
+  }
+  if (!out)
+    throw std::runtime_error("Cannot write binary data");
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef SERVER_DRAW_WRITER_HPP
+#define SERVER_DRAW_WRITER_HPP
+
+#include <server/protocol.hpp>
+#include <stan/callbacks/writer.hpp>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Sampler writer that streams the header and each draw of a chain as
+ * a part of a response as soon as the sampler produces it.  Each part
+ * starts with the chain identifier, so that the draws of several
+ * chains may share one response.  Chains running on different threads
+ * take turns writing through a shared mutex.  Messages such as the adapted step
+ * size are discarded.
+ */
+class draw_writer : public stan::callbacks::writer {
+ private:
+  response_writer& res_;
+  std::mutex& mutex_;
+  double chain_;
+  bool& header_written_;
+  std::int64_t& num_draws_;
+
+ public:
+  /**
+   * Construct a writer streaming draws of the specified chain to the
+   * specified response.
+   *
+   * @param res response to which to write
+   * @param mutex mutex guarding the response, shared by its chains
+   * @param chain identifier of chain
+   * @param header_written flag shared by the chains of a response,
+   * set once the header has been written
+   * @param num_draws count of draws written to the response, shared
+   * by its chains
+   */
+  draw_writer(response_writer& res, std::mutex& mutex, unsigned int chain,
+              bool& header_written, std::int64_t& num_draws)
+      : res_(res), mutex_(mutex), chain_(chain),
+        header_written_(header_written), num_draws_(num_draws) { }
+
+  /**
+   * Write the names of the columns, preceded by `chain__`, unless
+   * another chain has already written them.
+   *
+   * @param names names of columns
+   */
+  void operator()(const std::vector<std::string>& names) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (header_written_)
+      return;
+    res_.write_message("chain__");
+    res_.write_strings(names);
+    res_.end_part();
+    header_written_ = true;
+  }
+
+  /**
+   * Write the specified draw preceded by the chain identifier.
+   *
+   * @param state values of draw
+   */
+  void operator()(const std::vector<double>& state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    res_.write_double(chain_);
+    res_.write_doubles(state.data(), state.size());
+    res_.end_part();
+    ++num_draws_;
+  }
+
+  /**
+   * Discard the specified message, such as the adapted step size or
+   * the inverse metric.  Every part of a sampling response is the
+   * header or a draw, so messages have no place in it.
+   */
+  void operator()(const std::string&) { }
+
+  /**
+   * Discard the blank line the sampler writes between sections.
+   */
+  void operator()() { }
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef SERVER_LOG_DENSITY_TABLE_HPP
+#define SERVER_LOG_DENSITY_TABLE_HPP
+
+#include <stan/math.hpp>
+#include <stan/model/model_base.hpp>
+
+#include <ostream>
+
+/**
+ * Pointers to the log density functions of a model for one scalar
+ * type, indexed by whether constants are dropped and then by whether
+ * the change-of-variables adjustment is included.
+ *
+ * @tparam T real scalar type of parameters and log density
+ */
+template <typename T>
+struct log_prob_table {
+  /** Type of a log density function */
+  typedef T (*function)(const stan::model::model_base&,
+                        Eigen::Matrix<T, Eigen::Dynamic, 1>&, std::ostream*);
+
+  /** Functions indexed by `propto` and then `jacobian` */
+  function log_prob_[2][2];
+};
+
+/**
+ * Table of all log density functions of a model, one for each
+ * combination of dropping constants, including the change-of-variables
+ * adjustment, and scalar type.  Filling the table for the concrete
+ * model type (see `make_log_density_table`) lets each function call
+ * the model's own `log_prob` template directly, where the compiler
+ * can inline it, instead of going through the virtual functions of
+ * `model_base` and the branches choosing among them.
+ */
+struct log_density_table : log_prob_table<double>,
+                           log_prob_table<stan::math::var>
+#ifdef STAN_MODEL_FVAR_VAR
+    , log_prob_table<stan::math::fvar<stan::math::var>>
+#endif
+{
+  /**
+   * Return the log density function for the specified scalar type and
+   * flags.
+   *
+   * @tparam T real scalar type of parameters and log density
+   * @param[in] propto `true` if log density drops constant terms
+   * @param[in] jacobian `true` if log density includes change-of-variables
+   * terms
+   * @return log density function
+   */
+  template <typename T>
+  typename log_prob_table<T>::function log_prob(bool propto,
+                                                 bool jacobian) const {
+    return static_cast<const log_prob_table<T>&>(*this)
+        .log_prob_[propto][jacobian];
+  }
+};
+
+/**
+ * Return the log density of the specified model, which must be of
+ * the specified type, at the specified unconstrained parameters.
+ *
+ * @tparam M type of model
+ * @tparam propto `true` if log density drops constant terms
+ * @tparam jacobian `true` if log density includes change-of-variables
+ * terms
+ * @tparam T real scalar type of parameters and log density
+ * @param[in] model Stan model of type `M`
+ * @param[in] params_r unconstrained parameters
+ * @param[in] msgs stream for messages from the model
+ * @return log density
+ */
+template <class M, bool propto, bool jacobian, typename T>
+T concrete_log_prob(const stan::model::model_base& model,
+                    Eigen::Matrix<T, Eigen::Dynamic, 1>& params_r,
+                    std::ostream* msgs) {
+  return static_cast<const M&>(model)
+      .template log_prob<propto, jacobian>(params_r, msgs);
+}
+
+/**
+ * Fill the specified table with the log density functions of the
+ * specified model type.
+ *
+ * @tparam M type of model
+ * @tparam T real scalar type of parameters and log density
+ * @param[out] table table to fill
+ */
+template <class M, typename T>
+void fill_log_prob_table(log_prob_table<T>& table) {
+  table.log_prob_[false][false] = &concrete_log_prob<M, false, false, T>;
+  table.log_prob_[false][true] = &concrete_log_prob<M, false, true, T>;
+  table.log_prob_[true][false] = &concrete_log_prob<M, true, false, T>;
+  table.log_prob_[true][true] = &concrete_log_prob<M, true, true, T>;
+}
+
+/**
+ * Return the table of log density functions for the specified model
+ * type.  With `stan::model::model_base` as the type, the functions
+ * dispatch through its virtual functions and work for any model.
+ *
+ * @tparam M type of model
+ * @return table of log density functions
+ */
+template <class M>
+log_density_table make_log_density_table() {
+  log_density_table table;
+  fill_log_prob_table<M>(static_cast<log_prob_table<double>&>(table));
+  fill_log_prob_table<M>(
+      static_cast<log_prob_table<stan::math::var>&>(table));
+#ifdef STAN_MODEL_FVAR_VAR
+  fill_log_prob_table<M>(
+      static_cast<log_prob_table<stan::math::fvar<stan::math::var>>&>(table));
+#endif
+  return table;
+}
+
+/**
+ * Return the table of log density functions of the model returned by
+ * `new_model`.  It is defined in `src/model_hook.cpp`, which is
+ * compiled together with the generated model code so that the table
+ * is filled for the concrete model type.
+ *
+ * @return table of log density functions
+ */
+const log_density_table& model_log_density_table();
+
+#endif
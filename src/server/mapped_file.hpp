@@ -0,0 +1,84 @@
+#ifndef SERVER_MAPPED_FILE_HPP
+#define SERVER_MAPPED_FILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Read-only memory mapping of a whole file, so that large text files
+ * may be parsed in place without reading them into a buffer.  The
+ * pages are backed by the file, so the kernel may drop them under
+ * memory pressure rather than adding them to the peak memory of the
+ * process.  The file is unmapped when this object is destroyed.
+ */
+class mapped_file {
+ private:
+  const char* data_;
+  std::size_t size_;
+
+ public:
+  /**
+   * Map the file at the specified path.  An empty file is not mapped
+   * and has an empty range.
+   *
+   * @param path path of file
+   * @throw std::runtime_error if the file cannot be read or mapped
+   */
+  explicit mapped_file(const std::string& path) : data_(nullptr), size_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Cannot read input file: " + path);
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot size input file: " + path);
+    }
+    if (st.st_size == 0) {
+      ::close(fd);
+      return;
+    }
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Cannot map input file " + path + ": "
+                               + std::strerror(errno));
+    ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+    data_ = static_cast<const char*>(data);
+    size_ = st.st_size;
+  }
+
+  /**
+   * Unmap the file.
+   */
+  ~mapped_file() {
+    if (data_ != nullptr)
+      ::munmap(const_cast<char*>(data_), size_);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  /**
+   * Return a pointer to the first byte of the file.
+   *
+   * @return start of file
+   */
+  const char* begin() const { return data_; }
+
+  /**
+   * Return a pointer to one past the last byte of the file.
+   *
+   * @return end of file
+   */
+  const char* end() const { return data_ + size_; }
+};
+
+#endif
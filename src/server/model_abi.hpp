@@ -0,0 +1,66 @@
+#ifndef SERVER_MODEL_ABI_HPP
+#define SERVER_MODEL_ABI_HPP
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Version of the interface between the server and model libraries:
+ * the entry points of `src/model_hook.cpp` and the layout of
+ * `log_density_table`.  Increment it whenever either changes.
+ */
+constexpr std::uint32_t MODEL_ABI_VERSION = 1;
+
+/** Flag set if built with `STAN_MODEL_FVAR_VAR` (`HESSIAN_AD=true`) */
+constexpr std::uint32_t MODEL_ABI_FVAR_VAR = 1;
+
+/** Flag set if built with `STAN_THREADS` */
+constexpr std::uint32_t MODEL_ABI_THREADS = 2;
+
+/**
+ * Return the flags for the build settings of the code including this
+ * header that the server and a model library must agree on.
+ * `STAN_MODEL_FVAR_VAR` changes the virtual functions of `model_base`
+ * and the layout of `log_density_table`, and `STAN_THREADS` changes how
+ * the autodiff stacks the library shares with the server are declared.
+ *
+ * @return bitmask of `MODEL_ABI_` flags
+ */
+constexpr std::uint32_t model_abi_flags() {
+  return 0
+#ifdef STAN_MODEL_FVAR_VAR
+         | MODEL_ABI_FVAR_VAR
+#endif
+#ifdef STAN_THREADS
+         | MODEL_ABI_THREADS
+#endif
+      ;
+}
+
+/**
+ * Interface version and build flags, exported with C linkage by a
+ * model library as `stan_model_server_abi` so that a server can check
+ * them before calling into the library.
+ */
+struct model_abi {
+  /** Interface version, `MODEL_ABI_VERSION` when built */
+  std::uint32_t version_;
+
+  /** Build flags, `model_abi_flags()` when built */
+  std::uint32_t flags_;
+};
+
+/**
+ * Return a description of the specified build flags in terms of the
+ * make variables that set them, for error messages.
+ *
+ * @param[in] flags bitmask of `MODEL_ABI_` flags
+ * @return description of flags
+ */
+inline std::string describe_model_abi_flags(std::uint32_t flags) {
+  return std::string("HESSIAN_AD=")
+         + (flags & MODEL_ABI_FVAR_VAR ? "true" : "false")
+         + " STAN_THREADS=" + (flags & MODEL_ABI_THREADS ? "true" : "false");
+}
+
+#endif
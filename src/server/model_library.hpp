@@ -0,0 +1,150 @@
+#ifndef SERVER_MODEL_LIBRARY_HPP
+#define SERVER_MODEL_LIBRARY_HPP
+
+#include <server/log_density_table.hpp>
+#include <server/model_abi.hpp>
+#include <stan/io/var_context.hpp>
+#include <stan/model/model_base.hpp>
+
+#include <dlfcn.h>
+
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Type of the function, exported with C linkage by a model library,
+ * that allocates a new model given its data context, seed, and message
+ * stream (see `src/model_hook.cpp`).
+ */
+typedef stan::model::model_base* (*new_model_function)(
+    stan::io::var_context&, unsigned int, std::ostream*);
+
+/**
+ * Type of the function, exported with C linkage by a model library,
+ * that returns the table of log density functions of its model.
+ */
+typedef const log_density_table* (*log_density_table_function)();
+
+/**
+ * A `model_library` is a Stan model compiled as a shared library (the
+ * `%.so` make target) and loaded at runtime.  The library is unloaded
+ * when this object is destroyed, so the models it allocated must be
+ * deleted first.
+ *
+ * The server must be linked with its symbols exported (`-rdynamic`)
+ * so that the library shares the server's instances of the Stan Math
+ * globals, such as the autodiff stacks, rather than using its own.
+ */
+class model_library {
+ private:
+  void* handle_;
+  new_model_function new_model_;
+  log_density_table_function log_density_table_;
+
+  /**
+   * Return the address of the symbol with the specified name in the
+   * library.
+   *
+   * @param[in] name name of symbol
+   * @return address of symbol
+   * @throw std::runtime_error if the library does not define the symbol
+   */
+  void* symbol(const char* name) const {
+    void* address = dlsym(handle_, name);
+    if (address == nullptr)
+      throw std::runtime_error(std::string("Model library does not define ")
+                               + name);
+    return address;
+  }
+
+  /**
+   * Check that the library was built for the same interface version
+   * and with the same build settings as the server, without which
+   * calling into it would be undefined behavior.
+   *
+   * @param[in] abi interface version and build flags of the library
+   * @throw std::runtime_error if they differ from the server's
+   */
+  static void check_abi(const model_abi& abi) {
+    if (abi.version_ != MODEL_ABI_VERSION)
+      throw std::runtime_error("Model library has interface version "
+                               + std::to_string(abi.version_)
+                               + " but the server has version "
+                               + std::to_string(MODEL_ABI_VERSION)
+                               + "; rebuild the library");
+    if (abi.flags_ != model_abi_flags())
+      throw std::runtime_error("Model library was built with "
+                               + describe_model_abi_flags(abi.flags_)
+                               + " but the server with "
+                               + describe_model_abi_flags(model_abi_flags())
+                               + "; rebuild the library with the server's"
+                               " settings");
+  }
+
+ public:
+  /**
+   * Load the model library at the specified path.  A path without a
+   * directory is taken relative to the working directory rather than
+   * searched for in the library path.
+   *
+   * @param[in] path path of shared library
+   * @throw std::runtime_error if the library cannot be loaded, does
+   * not define the model functions, or was built with different
+   * settings than the server
+   */
+  explicit model_library(const std::string& path)
+      : handle_(dlopen((path.find('/') == std::string::npos ? "./" + path
+                                                              : path).c_str(),
+                       RTLD_NOW | RTLD_LOCAL)) {
+    if (handle_ == nullptr)
+      throw std::runtime_error("Cannot load model library: "
+                               + std::string(dlerror()));
+    try {
+      check_abi(*static_cast<const model_abi*>(
+          symbol("stan_model_server_abi")));
+      new_model_ = reinterpret_cast<new_model_function>(
+          symbol("stan_model_server_new_model"));
+      log_density_table_ = reinterpret_cast<log_density_table_function>(
+          symbol("stan_model_server_log_density_table"));
+    } catch (...) {
+      dlclose(handle_);
+      throw;
+    }
+  }
+
+  model_library(const model_library&) = delete;
+  model_library& operator=(const model_library&) = delete;
+
+  /**
+   * Unload the library.
+   */
+  ~model_library() { dlclose(handle_); }
+
+  /**
+   * Allocate and return a new model as a reference given the specified
+   * data context, seed, and message stream.
+   *
+   * @param[in] data_context context for reading model data
+   * @param[in] seed random seed for transformed data block
+   * @param[in] msg_stream stream to which to send messages printed by
+   * the model
+   * @return model allocated with `new`
+   */
+  stan::model::model_base& new_model(stan::io::var_context& data_context,
+                                     unsigned int seed,
+                                     std::ostream* msg_stream) const {
+    return *new_model_(data_context, seed, msg_stream);
+  }
+
+  /**
+   * Return the table of log density functions of the library's model.
+   *
+   * @return table of log density functions
+   */
+  const log_density_table& log_densities() const {
+    return *log_density_table_();
+  }
+};
+
+#endif
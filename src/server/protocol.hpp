@@ -0,0 +1,654 @@
+#ifndef SERVER_PROTOCOL_HPP
+#define SERVER_PROTOCOL_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Status codes returned by the server.  In the text protocol these
+ * are signaled by the special lines `ERROR` and `UNKNOWN`; in the
+ * binary protocol they are written into the `flags` field of the
+ * response header.  Instructions that stream their results send any
+ * number of `PARTIAL` responses before the final one.
+ */
+enum class response_status : std::uint16_t {
+  OK = 0,
+  ERROR = 1,
+  UNKNOWN = 2,
+  PARTIAL = 3
+};
+
+/**
+ * Fixed-size header preceding every binary request and response.
+ * All fields are little endian.
+ *
+ * For requests, `opcode` is the instruction code and bit `k` of
+ * `flags` holds the `k`-th boolean argument of the instruction.  For
+ * responses, `opcode` echoes the request's code and `flags` holds a
+ * `response_status`.  The `length` field is the number of payload
+ * bytes following the header.
+ */
+struct binary_header {
+  /** Instruction code */
+  std::uint16_t opcode;
+
+  /** Boolean arguments for requests or status for responses */
+  std::uint16_t flags;
+
+  /** Reserved for future use; must be zero */
+  std::uint32_t reserved;
+
+  /** Number of payload bytes following the header */
+  std::uint64_t length;
+};
+
+static_assert(sizeof(binary_header) == 16,
+              "binary_header must be packed into 16 bytes");
+
+/**
+ * Return `true` if the host stores integers and floating-point
+ * numbers in little-endian byte order, as required by the binary
+ * protocol.
+ *
+ * @return `true` if the host is little endian
+ */
+inline bool is_little_endian() {
+  const std::uint16_t one = 1;
+  unsigned char first_byte;
+  std::memcpy(&first_byte, &one, 1);
+  return first_byte == 1;
+}
+
+/**
+ * Abstract base class for reading the arguments of a REPL
+ * instruction.  Arguments are read in order, so that the same
+ * instruction code may be used for each protocol.
+ */
+struct request_reader {
+  virtual ~request_reader() { }
+
+  /**
+   * Return the next boolean argument.
+   *
+   * @return boolean argument
+   * @throw std::invalid_argument if there are no more boolean arguments
+   */
+  virtual bool read_bool() = 0;
+
+  /**
+   * Return the next option argument, a small non-negative integer
+   * that fits in the specified number of bits.  Text requests give
+   * the option as a decimal integer and binary requests as the next
+   * `bits` bits of the flags, lowest bit first, so that an option
+   * with value 0 or 1 is compatible with a boolean argument.
+   *
+   * @param bits number of bits in the option
+   * @return option argument
+   * @throw std::invalid_argument if there are no more option arguments
+   * or the value does not fit in the specified number of bits
+   */
+  virtual int read_option(int bits) = 0;
+
+  /**
+   * Return the next integer argument.
+   *
+   * @return integer argument
+   * @throw std::invalid_argument if there are no more integer arguments
+   */
+  virtual std::int64_t read_int() = 0;
+
+  /**
+   * Read the specified number of double-precision arguments into the
+   * specified array.
+   *
+   * @param[out] x array into which values are read
+   * @param[in] n number of values to read
+   * @throw std::invalid_argument if there are fewer than `n` values left
+   */
+  virtual void read_doubles(double* x, std::size_t n) = 0;
+
+  /**
+   * Return an upper bound on the number of double-precision arguments
+   * left in the request, so that a count read from the request can be
+   * checked before allocating memory for the values.
+   *
+   * @return maximum number of values left
+   */
+  virtual std::size_t max_doubles() const = 0;
+
+  /**
+   * Return the rest of the request as a string.
+   *
+   * @return remaining request
+   */
+  virtual std::string read_rest() = 0;
+
+  /**
+   * Return `true` if no arguments remain to be read, so that an
+   * instruction may take optional trailing arguments.
+   *
+   * @return `true` if the request has been read
+   */
+  virtual bool at_end() = 0;
+};
+
+/**
+ * Abstract base class for writing the result of a REPL instruction.
+ * Values are accumulated with the `write_` functions and the response
+ * is completed with a single call to `end()` or `end_error()`.
+ */
+struct response_writer {
+  virtual ~response_writer() { }
+
+  /**
+   * Write the specified integer.
+   *
+   * @param n integer to write
+   */
+  virtual void write_int(std::int64_t n) = 0;
+
+  /**
+   * Write the specified number of double-precision values from the
+   * specified array.
+   *
+   * @param x array of values to write
+   * @param n number of values to write
+   */
+  virtual void write_doubles(const double* x, std::size_t n) = 0;
+
+  /**
+   * Write the specified strings as a comma-separated sequence.
+   *
+   * @param xs strings to write
+   */
+  virtual void write_strings(const std::vector<std::string>& xs) = 0;
+
+  /**
+   * Write the specified message.
+   *
+   * @param msg message to write
+   */
+  virtual void write_message(const std::string& msg) = 0;
+
+  /**
+   * Send what has been written so far as a part of a streamed
+   * response and start the next part.
+   */
+  virtual void end_part() = 0;
+
+  /**
+   * Complete a successful response.
+   */
+  virtual void end() = 0;
+
+  /**
+   * Discard what has been written if possible and complete a failed
+   * response with the specified status and message.
+   *
+   * @param status status of response
+   * @param msg error message
+   */
+  virtual void end_error(response_status status, const std::string& msg) = 0;
+
+  /**
+   * Write the specified double-precision value.
+   *
+   * @param x value to write
+   */
+  void write_double(double x) {
+    write_doubles(&x, 1);
+  }
+};
+
+/**
+ * Request reader for the line-based text protocol.  Arguments are
+ * separated by whitespace and parsed in place from a single line of
+ * input, without the heap allocation that stream extraction of
+ * floating-point numbers incurs.
+ */
+struct text_request_reader : public request_reader {
+  /** Position of next character to read */
+  const char* pos_;
+
+  /** One past the last character of the line, which is null */
+  const char* end_;
+
+  /**
+   * Construct a reader for arguments from the specified range of a
+   * null-terminated line, such as the characters of a string
+   * following the instruction name.
+   *
+   * @param begin pointer to first character of arguments
+   * @param end pointer to terminating null character
+   */
+  text_request_reader(const char* begin, const char* end)
+      : pos_(begin), end_(end) { }
+
+  /**
+   * Return the next integer argument, or throw an exception with the
+   * specified message if there is none.
+   *
+   * @param msg message for exception
+   * @return integer argument
+   * @throw std::invalid_argument if there are no more integer arguments
+   */
+  long long parse_int(const char* msg) {
+    char* next;
+    errno = 0;
+    long long n = std::strtoll(pos_, &next, 10);
+    if (next == pos_ || errno == ERANGE)
+      throw std::invalid_argument(msg);
+    pos_ = next;
+    return n;
+  }
+
+  bool read_bool() {
+    const char* msg = "expected boolean argument (0 or 1)";
+    long long n = parse_int(msg);
+    if (n != 0 && n != 1)
+      throw std::invalid_argument(msg);
+    return n == 1;
+  }
+
+  int read_option(int bits) {
+    char* next;
+    errno = 0;
+    long long n = std::strtoll(pos_, &next, 10);
+    if (next == pos_ || errno == ERANGE || n < 0 || n >= (1 << bits))
+      throw std::invalid_argument("expected option argument between 0 and "
+                                  + std::to_string((1 << bits) - 1));
+    pos_ = next;
+    return static_cast<int>(n);
+  }
+
+  std::int64_t read_int() {
+    return parse_int("expected integer argument");
+  }
+
+  void read_doubles(double* x, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      char* next;
+      x[i] = std::strtod(pos_, &next);
+      if (next == pos_)
+        throw std::invalid_argument("expected floating-point argument");
+      pos_ = next;
+    }
+  }
+
+  /**
+   * Return an upper bound on the number of values left, each of which
+   * takes at least one character and a separator.
+   *
+   * @return maximum number of values left
+   */
+  std::size_t max_doubles() const {
+    return (end_ - pos_ + 1) / 2;
+  }
+
+  std::string read_rest() {
+    std::string rest(pos_, end_);
+    pos_ = end_;
+    return rest;
+  }
+
+  bool at_end() {
+    while (pos_ != end_ && std::isspace(static_cast<unsigned char>(*pos_)))
+      ++pos_;
+    return pos_ == end_;
+  }
+};
+
+/**
+ * Response writer for the line-based text protocol.  Values are
+ * written as a single comma-separated line terminated by a newline.
+ */
+struct text_response_writer : public response_writer {
+  /** Output stream */
+  std::ostream& out_;
+
+  /** `true` if nothing has been written to the current line */
+  bool first_;
+
+  /**
+   * Construct a writer for the specified output stream.
+   *
+   * @param out output stream
+   */
+  explicit text_response_writer(std::ostream& out) : out_(out), first_(true) { }
+
+  /**
+   * Write a comma if this is not the first value on the line.
+   */
+  void separate() {
+    if (!first_) out_ << ',';
+    first_ = false;
+  }
+
+  void write_int(std::int64_t n) {
+    separate();
+    out_ << n;
+  }
+
+  void write_doubles(const double* x, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      separate();
+      out_ << x[i];
+    }
+  }
+
+  void write_strings(const std::vector<std::string>& xs) {
+    for (const auto& x : xs) {
+      separate();
+      out_ << x;
+    }
+  }
+
+  void write_message(const std::string& msg) {
+    separate();
+    out_ << msg;
+  }
+
+  void end_part() {
+    out_ << std::endl;
+    first_ = true;
+  }
+
+  void end() {
+    out_ << std::endl;
+  }
+
+  /**
+   * End the response with a line holding the status, `ERROR` or
+   * `UNKNOWN`, followed by a colon and the message, with any line
+   * breaks in the message replaced by spaces.
+   *
+   * @param status status of response
+   * @param msg error message
+   */
+  void end_error(response_status status, const std::string& msg) {
+    if (!first_) out_ << std::endl;
+    out_ << (status == response_status::UNKNOWN ? "UNKNOWN" : "ERROR");
+    if (!msg.empty()) {
+      out_ << ": ";
+      for (char c : msg)
+        out_ << (c == '\n' || c == '\r' ? ' ' : c);
+    }
+    out_ << std::endl;
+  }
+};
+
+/**
+ * Request reader for the binary protocol.  Boolean arguments are
+ * taken in order from the bits of the header's flags and all other
+ * arguments are read in order from the payload, with integers encoded
+ * as 64-bit signed integers and floating-point values as 64-bit IEEE
+ * doubles.  The rest of the payload may be read as a UTF-8 string.
+ */
+struct binary_request_reader : public request_reader {
+  /** Boolean arguments as bits */
+  std::uint16_t flags_;
+
+  /** Index of next bit of flags to read */
+  int flag_pos_;
+
+  /** Pointer to the payload */
+  const char* data_;
+
+  /** Size of payload in bytes */
+  std::size_t size_;
+
+  /** Position of next byte of payload to read */
+  std::size_t pos_;
+
+  /**
+   * Construct a reader for the specified boolean flags and payload.
+   * The payload is not copied and must outlive the reader.
+   *
+   * @param flags boolean arguments as bits
+   * @param data pointer to payload
+   * @param size size of payload in bytes
+   */
+  binary_request_reader(std::uint16_t flags, const char* data,
+                        std::size_t size)
+      : flags_(flags), flag_pos_(0), data_(data), size_(size), pos_(0) { }
+
+  /**
+   * Throw an exception if fewer than the specified number of values
+   * of the specified size remain in the payload.  The sizes are not
+   * multiplied, so that a huge count cannot overflow.
+   *
+   * @param n number of values required
+   * @param size size of each value in bytes
+   * @throw std::invalid_argument if fewer than `n` values remain
+   */
+  void require(std::size_t n, std::size_t size) const {
+    if (n > (size_ - pos_) / size)
+      throw std::invalid_argument("binary request payload too short");
+  }
+
+  bool read_bool() {
+    if (flag_pos_ >= 16)
+      throw std::invalid_argument("too many boolean arguments");
+    return (flags_ >> flag_pos_++) & 1;
+  }
+
+  int read_option(int bits) {
+    if (flag_pos_ + bits > 16)
+      throw std::invalid_argument("too many boolean arguments");
+    int n = (flags_ >> flag_pos_) & ((1 << bits) - 1);
+    flag_pos_ += bits;
+    return n;
+  }
+
+  std::int64_t read_int() {
+    require(1, sizeof(std::int64_t));
+    std::int64_t n;
+    std::memcpy(&n, data_ + pos_, sizeof(n));
+    pos_ += sizeof(n);
+    return n;
+  }
+
+  void read_doubles(double* x, std::size_t n) {
+    require(n, sizeof(double));
+    std::memcpy(x, data_ + pos_, n * sizeof(double));
+    pos_ += n * sizeof(double);
+  }
+
+  std::size_t max_doubles() const {
+    return (size_ - pos_) / sizeof(double);
+  }
+
+  std::string read_rest() {
+    std::string rest(data_ + pos_, size_ - pos_);
+    pos_ = size_;
+    return rest;
+  }
+
+  bool at_end() {
+    return pos_ == size_;
+  }
+};
+
+/**
+ * Response writer for the binary protocol.  The payload is buffered
+ * and written after its header when the response ends.  Integers are
+ * written as 64-bit signed integers, floating-point values as 64-bit
+ * IEEE doubles, and strings as UTF-8 text with comma-separated
+ * sequences.
+ *
+ * The payload may instead be written directly into a fixed buffer
+ * shared with the client, in which case only the header is written
+ * to the output stream.
+ */
+struct binary_response_writer : public response_writer {
+  /** Output stream */
+  std::ostream& out_;
+
+  /** Instruction code echoed in the response header */
+  std::uint16_t opcode_;
+
+  /** Buffered payload, or null if writing into a fixed buffer */
+  std::vector<char>* payload_;
+
+  /** Fixed buffer for payload, or null if buffering */
+  char* fixed_;
+
+  /** Capacity of fixed buffer in bytes */
+  std::size_t capacity_;
+
+  /** Number of bytes written to fixed buffer */
+  std::size_t size_;
+
+  /** `true` if no string has been written to the payload */
+  bool first_;
+
+  /**
+   * Construct a writer for the specified output stream, instruction
+   * code, and payload buffer.  The buffer is cleared and reused so
+   * that its memory may be retained between responses.
+   *
+   * @param out output stream
+   * @param opcode instruction code echoed in response header
+   * @param payload buffer for payload
+   */
+  binary_response_writer(std::ostream& out, std::uint16_t opcode,
+                         std::vector<char>& payload)
+      : out_(out), opcode_(opcode), payload_(&payload), fixed_(nullptr),
+        capacity_(0), size_(0), first_(true) {
+    payload_->clear();
+  }
+
+  /**
+   * Construct a writer for the specified output stream and
+   * instruction code that writes the payload into the specified fixed
+   * buffer rather than the output stream.
+   *
+   * @param out output stream
+   * @param opcode instruction code echoed in response header
+   * @param buffer fixed buffer for payload
+   * @param capacity capacity of buffer in bytes
+   */
+  binary_response_writer(std::ostream& out, std::uint16_t opcode,
+                         char* buffer, std::size_t capacity)
+      : out_(out), opcode_(opcode), payload_(nullptr), fixed_(buffer),
+        capacity_(capacity), size_(0), first_(true) { }
+
+  /**
+   * Return the number of payload bytes written so far.
+   *
+   * @return size of payload
+   */
+  std::size_t size() const {
+    return payload_ != nullptr ? payload_->size() : size_;
+  }
+
+  /**
+   * Append the specified bytes to the payload.
+   *
+   * @param x pointer to bytes
+   * @param n number of bytes
+   * @throw std::length_error if the payload would exceed the capacity
+   * of a fixed buffer
+   */
+  void append(const void* x, std::size_t n) {
+    const char* bytes = static_cast<const char*>(x);
+    if (payload_ != nullptr) {
+      payload_->insert(payload_->end(), bytes, bytes + n);
+      return;
+    }
+    if (n > capacity_ - size_)
+      throw std::length_error("response exceeds shared memory capacity of "
+                              + std::to_string(capacity_) + " bytes");
+    std::memcpy(fixed_ + size_, bytes, n);
+    size_ += n;
+  }
+
+  void write_int(std::int64_t n) {
+    append(&n, sizeof(n));
+  }
+
+  void write_doubles(const double* x, std::size_t n) {
+    append(x, n * sizeof(double));
+  }
+
+  void write_strings(const std::vector<std::string>& xs) {
+    for (const auto& x : xs)
+      write_message(x);
+  }
+
+  void write_message(const std::string& msg) {
+    if (!first_) append(",", 1);
+    first_ = false;
+    append(msg.data(), msg.size());
+  }
+
+  /**
+   * Write the header with the specified status, followed by the
+   * payload if specified, and flush the output stream.
+   *
+   * @param status status of response
+   * @param with_payload `true` to write the payload after the header
+   */
+  void send(response_status status, bool with_payload) {
+    binary_header header;
+    header.opcode = opcode_;
+    header.flags = static_cast<std::uint16_t>(status);
+    header.reserved = 0;
+    header.length = size();
+    out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (with_payload)
+      out_.write(payload_ != nullptr ? payload_->data() : fixed_, size());
+    out_.flush();
+  }
+
+  /**
+   * Write the header with the specified status followed by any
+   * buffered payload and flush the output stream.
+   *
+   * @param status status of response
+   */
+  void send(response_status status) {
+    send(status, payload_ != nullptr);
+  }
+
+  /**
+   * Send the payload written so far in a response with status
+   * `PARTIAL` and start a new payload.  Partial payloads always
+   * follow their header on the output stream, even when writing into
+   * a fixed buffer, so that the next part cannot overwrite a part the
+   * client has not read.
+   */
+  void end_part() {
+    send(response_status::PARTIAL, true);
+    if (payload_ != nullptr)
+      payload_->clear();
+    size_ = 0;
+    first_ = true;
+  }
+
+  void end() {
+    send(response_status::OK);
+  }
+
+  void end_error(response_status status, const std::string& msg) {
+    if (payload_ != nullptr) {
+      payload_->assign(msg.begin(), msg.end());
+    } else {
+      size_ = 0;
+      append(msg.data(), std::min(msg.size(), capacity_));
+    }
+    send(status);
+  }
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef SERVER_SHARED_MEMORY_HPP
+#define SERVER_SHARED_MEMORY_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+/**
+ * POSIX shared-memory segment created by a client and mapped by the
+ * server for exchanging binary payloads without copying them through
+ * a pipe or socket.  The segment is split into two halves of equal
+ * capacity, the first holding request payloads and the second
+ * response payloads.  The segment is unmapped when this object is
+ * destroyed; removing its name is up to the client that created it.
+ */
+class shared_memory {
+ private:
+  char* data_;
+  std::size_t size_;
+  std::size_t capacity_;
+
+  /** Alignment of the response half, enough for doubles */
+  static constexpr std::size_t ALIGNMENT = 64;
+
+ public:
+  /**
+   * Map the existing shared-memory segment with the specified name.
+   *
+   * @param name name of segment as passed to `shm_open`
+   * @throw std::runtime_error if the segment cannot be opened or mapped,
+   * or is too small to hold two aligned halves
+   */
+  explicit shared_memory(const std::string& name)
+      : data_(nullptr), size_(0), capacity_(0) {
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      throw std::runtime_error("Cannot open shared memory " + name + ": "
+                               + std::strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot size shared memory " + name);
+    }
+    if (st.st_size < static_cast<off_t>(2 * ALIGNMENT)) {
+      ::close(fd);
+      throw std::runtime_error("Shared memory " + name + " is smaller than "
+                               + std::to_string(2 * ALIGNMENT) + " bytes");
+    }
+    std::size_t size = st.st_size;
+    void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Cannot map shared memory " + name + ": "
+                               + std::strerror(errno));
+    data_ = static_cast<char*>(data);
+    size_ = size;
+    // keep the response half aligned for doubles
+    capacity_ = (size / 2) & ~(ALIGNMENT - 1);
+  }
+
+  /**
+   * Unmap the segment.
+   */
+  ~shared_memory() {
+    if (data_ != nullptr)
+      ::munmap(data_, size_);
+  }
+
+  shared_memory(const shared_memory&) = delete;
+  shared_memory& operator=(const shared_memory&) = delete;
+
+  /**
+   * Return the capacity in bytes of each of the request and response
+   * buffers.
+   *
+   * @return capacity of each buffer
+   */
+  std::size_t capacity() const { return capacity_; }
+
+  /**
+   * Return a pointer to the request buffer.
+   *
+   * @return request buffer
+   */
+  const char* request() const { return data_; }
+
+  /**
+   * Return a pointer to the response buffer.
+   *
+   * @return response buffer
+   */
+  char* response() { return data_ + capacity_; }
+};
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef SERVER_SOCKET_HPP
+#define SERVER_SOCKET_HPP
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/**
+ * Return an exception for the last system error prefixed by the
+ * specified message.
+ *
+ * @param msg message describing the failed operation
+ * @return exception to throw
+ */
+inline std::runtime_error socket_error(const std::string& msg) {
+  return std::runtime_error(msg + ": " + std::strerror(errno));
+}
+
+/**
+ * Buffered stream buffer reading from and writing to a file
+ * descriptor such as a connected socket.  The descriptor is closed
+ * when the buffer is destroyed.  Reads and writes larger than the
+ * buffer bypass it.
+ */
+class fd_streambuf : public std::streambuf {
+ private:
+  int fd_;
+  std::vector<char> in_buf_;
+  std::vector<char> out_buf_;
+
+  /**
+   * Write the specified bytes to the descriptor, retrying until all
+   * are written.
+   *
+   * @param data pointer to bytes
+   * @param n number of bytes
+   * @return `true` if all bytes were written
+   */
+  bool write_all(const char* data, std::size_t n) {
+    while (n > 0) {
+      ssize_t written = ::write(fd_, data, n);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return false;
+      data += written;
+      n -= written;
+    }
+    return true;
+  }
+
+  /**
+   * Read up to the specified number of bytes from the descriptor.
+   *
+   * @param data pointer to destination
+   * @param n maximum number of bytes
+   * @return number of bytes read, zero at end of input or on error
+   */
+  std::size_t read_some(char* data, std::size_t n) {
+    ssize_t received;
+    do {
+      received = ::read(fd_, data, n);
+    } while (received < 0 && errno == EINTR);
+    return received > 0 ? received : 0;
+  }
+
+  /**
+   * Write the buffered output to the descriptor.
+   *
+   * @return `true` if successful
+   */
+  bool flush_output() {
+    bool ok = write_all(pbase(), pptr() - pbase());
+    setp(out_buf_.data(), out_buf_.data() + out_buf_.size());
+    return ok;
+  }
+
+ protected:
+  int_type underflow() {
+    std::size_t n = read_some(in_buf_.data(), in_buf_.size());
+    if (n == 0)
+      return traits_type::eof();
+    setg(in_buf_.data(), in_buf_.data(), in_buf_.data() + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  std::streamsize xsgetn(char* s, std::streamsize n) {
+    std::streamsize total = 0;
+    while (total < n) {
+      std::streamsize buffered = egptr() - gptr();
+      if (buffered > 0) {
+        std::streamsize k = std::min(buffered, n - total);
+        std::memcpy(s + total, gptr(), k);
+        gbump(static_cast<int>(k));
+        total += k;
+      } else if (n - total >= static_cast<std::streamsize>(in_buf_.size())) {
+        std::size_t k = read_some(s + total, n - total);
+        if (k == 0)
+          break;
+        total += k;
+      } else if (underflow() == traits_type::eof()) {
+        break;
+      }
+    }
+    return total;
+  }
+
+  int_type overflow(int_type c) {
+    if (!flush_output())
+      return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char* s, std::streamsize n) {
+    if (n < epptr() - pptr()) {
+      std::memcpy(pptr(), s, n);
+      pbump(static_cast<int>(n));
+      return n;
+    }
+    if (!flush_output() || !write_all(s, n))
+      return 0;
+    return n;
+  }
+
+  int sync() {
+    return flush_output() ? 0 : -1;
+  }
+
+ public:
+  /**
+   * Construct a stream buffer for the specified open descriptor,
+   * taking ownership of it.
+   *
+   * @param fd file descriptor
+   * @param buffer_size size of input and output buffers in bytes
+   */
+  explicit fd_streambuf(int fd, std::size_t buffer_size = 65536)
+      : fd_(fd), in_buf_(buffer_size), out_buf_(buffer_size) {
+    setg(in_buf_.data(), in_buf_.data(), in_buf_.data());
+    setp(out_buf_.data(), out_buf_.data() + out_buf_.size());
+  }
+
+  /**
+   * Flush buffered output and close the descriptor.
+   */
+  ~fd_streambuf() {
+    sync();
+    ::close(fd_);
+  }
+};
+
+/**
+ * Stream buffer that collects output and writes it to a shared
+ * stream under a mutex whenever it is flushed, so that sessions
+ * running on different threads may share the error stream without
+ * interleaving their lines.
+ */
+class locked_streambuf : public std::stringbuf {
+ private:
+  std::ostream& out_;
+  std::mutex& mutex_;
+
+ protected:
+  int sync() {
+    std::string msg = str();
+    if (msg.empty())
+      return 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    out_ << msg;
+    out_.flush();
+    str("");
+    return 0;
+  }
+
+ public:
+  /**
+   * Construct a stream buffer writing to the specified stream under
+   * the specified mutex.
+   *
+   * @param out shared output stream
+   * @param mutex mutex guarding the shared stream
+   */
+  locked_streambuf(std::ostream& out, std::mutex& mutex)
+      : out_(out), mutex_(mutex) { }
+
+  /**
+   * Write any remaining output.
+   */
+  ~locked_streambuf() { sync(); }
+};
+
+/**
+ * Socket listening for connections on a Unix domain socket or TCP
+ * port.  Addresses are given as `unix:<path>`, `tcp:<port>` for the
+ * loopback interface, or `tcp:<host>:<port>`.  The socket is closed,
+ * and a Unix domain socket's path removed, when the listener is
+ * destroyed.
+ */
+class listener {
+ private:
+  int fd_;
+  bool tcp_;
+  std::string unix_path_;
+
+  /**
+   * Bind and listen on the Unix domain socket at the specified path,
+   * replacing a stale socket file left at the path.
+   *
+   * @param path path of socket
+   * @throw std::runtime_error if the socket cannot be created
+   */
+  void listen_unix(const std::string& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("Invalid Unix socket path: " + path);
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+      ::unlink(path.c_str());
+    fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0)
+      throw socket_error("Cannot create socket");
+    if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+      throw socket_error("Cannot bind socket " + path);
+    unix_path_ = path;
+  }
+
+  /**
+   * Bind and listen on the specified TCP host and port.
+   *
+   * @param host host name or address
+   * @param port port number or service name
+   * @throw std::runtime_error if the socket cannot be created
+   */
+  void listen_tcp(const std::string& host, const std::string& port) {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* info;
+    int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &info);
+    if (rc != 0)
+      throw std::runtime_error("Cannot resolve " + host + ":" + port + ": "
+                               + ::gai_strerror(rc));
+    fd_ = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd_ < 0) {
+      ::freeaddrinfo(info);
+      throw socket_error("Cannot create socket");
+    }
+    int on = 1;
+    ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    rc = ::bind(fd_, info->ai_addr, info->ai_addrlen);
+    ::freeaddrinfo(info);
+    if (rc < 0)
+      throw socket_error("Cannot bind socket " + host + ":" + port);
+    tcp_ = true;
+  }
+
+ public:
+  /**
+   * Construct a listener on the specified address.
+   *
+   * @param address address in the form `unix:<path>`, `tcp:<port>`, or
+   * `tcp:<host>:<port>`
+   * @throw std::runtime_error if the address is malformed or the
+   * socket cannot be created
+   */
+  explicit listener(const std::string& address) : fd_(-1), tcp_(false) {
+    try {
+      if (address.compare(0, 5, "unix:") == 0) {
+        listen_unix(address.substr(5));
+      } else if (address.compare(0, 4, "tcp:") == 0) {
+        std::string spec = address.substr(4);
+        std::size_t colon = spec.rfind(':');
+        if (colon == std::string::npos)
+          listen_tcp("localhost", spec);
+        else
+          listen_tcp(spec.substr(0, colon), spec.substr(colon + 1));
+      } else {
+        throw std::runtime_error("Unknown listen address: " + address
+                                 + " (expected unix:<path> or tcp:<port>)");
+      }
+      if (::listen(fd_, SOMAXCONN) < 0)
+        throw socket_error("Cannot listen on " + address);
+    } catch (...) {
+      close();
+      throw;
+    }
+  }
+
+  /**
+   * Close the socket.
+   */
+  ~listener() { close(); }
+
+  listener(const listener&) = delete;
+  listener& operator=(const listener&) = delete;
+
+  /**
+   * Close the socket and remove the path of a Unix domain socket.
+   */
+  void close() {
+    if (fd_ >= 0)
+      ::close(fd_);
+    fd_ = -1;
+    if (!unix_path_.empty())
+      ::unlink(unix_path_.c_str());
+    unix_path_.clear();
+  }
+
+  /**
+   * Block until a client connects and return the connected
+   * descriptor.  TCP connections have Nagle's algorithm disabled
+   * because requests and responses are small and synchronous.
+   *
+   * @return connected file descriptor
+   * @throw std::runtime_error if accepting fails
+   */
+  int accept() {
+    int fd;
+    do {
+      fd = ::accept(fd_, nullptr, nullptr);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+      throw socket_error("Cannot accept connection");
+    if (tcp_) {
+      int on = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+  }
+};
+
+#endif
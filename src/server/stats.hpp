@@ -0,0 +1,361 @@
+#ifndef SERVER_STATS_HPP
+#define SERVER_STATS_HPP
+
+#include <server/protocol.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Histogram of latencies in nanoseconds with logarithmically sized
+ * buckets.  Latencies below 16ns have their own buckets and each
+ * larger power of two is split into eight buckets, so quantiles are
+ * accurate to within 12.5%.  Recording a latency does not allocate.
+ */
+class latency_histogram {
+ private:
+  static constexpr int SUB_BUCKET_BITS = 3;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr int LINEAR_BUCKETS = 2 * SUB_BUCKETS;
+  static constexpr int NUM_BUCKETS = LINEAR_BUCKETS + (64 - 4) * SUB_BUCKETS;
+
+  std::uint64_t counts_[NUM_BUCKETS];
+  std::uint64_t count_;
+  std::uint64_t max_;
+
+  /**
+   * Return the bucket holding the specified latency.
+   *
+   * @param ns latency in nanoseconds
+   * @return index of bucket
+   */
+  static int bucket(std::uint64_t ns) {
+    if (ns < LINEAR_BUCKETS)
+      return static_cast<int>(ns);
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return LINEAR_BUCKETS + (exponent - 4) * SUB_BUCKETS + sub;
+  }
+
+  /**
+   * Return the largest latency held by the specified bucket.
+   *
+   * @param b index of bucket
+   * @return upper bound of bucket in nanoseconds
+   */
+  static std::uint64_t upper_bound(int b) {
+    if (b < LINEAR_BUCKETS)
+      return b;
+    int exponent = (b - LINEAR_BUCKETS) / SUB_BUCKETS + 4;
+    std::uint64_t sub = (b - LINEAR_BUCKETS) % SUB_BUCKETS;
+    std::uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return (SUB_BUCKETS + sub + 1) * width - 1;
+  }
+
+ public:
+  latency_histogram() : counts_(), count_(0), max_(0) { }
+
+  /**
+   * Record the specified latency.
+   *
+   * @param ns latency in nanoseconds
+   */
+  void record(std::uint64_t ns) {
+    ++counts_[bucket(ns)];
+    ++count_;
+    if (ns > max_)
+      max_ = ns;
+  }
+
+  /**
+   * Return the number of latencies recorded.
+   *
+   * @return number of latencies
+   */
+  std::uint64_t count() const { return count_; }
+
+  /**
+   * Return the largest latency recorded, or zero if none were.
+   *
+   * @return maximum latency in nanoseconds
+   */
+  std::uint64_t max() const { return max_; }
+
+  /**
+   * Return an upper bound on the specified quantile of the recorded
+   * latencies, or zero if none were recorded.
+   *
+   * @param q quantile between 0 and 1
+   * @return quantile in nanoseconds
+   */
+  std::uint64_t quantile(double q) const {
+    std::uint64_t rank = static_cast<std::uint64_t>(q * count_ + 0.5);
+    if (rank < 1)
+      rank = 1;
+    std::uint64_t seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; ++b) {
+      seen += counts_[b];
+      if (seen >= rank)
+        return upper_bound(b) < max_ ? upper_bound(b) : max_;
+    }
+    return max_;
+  }
+};
+
+/**
+ * Phases of handling a request.  Parsing covers reading the request
+ * and its arguments, evaluation everything up to the first value
+ * written to the response, and serialization writing and sending the
+ * response.
+ */
+enum request_phase {
+  PHASE_PARSE = 0,
+  PHASE_EVAL = 1,
+  PHASE_SERIALIZE = 2,
+  PHASE_TOTAL = 3,
+  NUM_PHASES = 4
+};
+
+/**
+ * Return the name of the specified phase as used in statistics.
+ *
+ * @param phase phase of request
+ * @return name of phase
+ */
+inline const char* phase_name(int phase) {
+  static const char* const names[NUM_PHASES]
+      = {"parse", "eval", "serialize", "total"};
+  return names[phase];
+}
+
+/**
+ * Timestamps marking the phases of the request being handled.
+ */
+struct request_timer {
+  typedef std::chrono::steady_clock clock;
+
+  /** Time at which the request was received */
+  clock::time_point start_;
+
+  /** Time at which the last argument was read */
+  clock::time_point parsed_;
+
+  /** Time at which the first value was written to the response */
+  clock::time_point evaluated_;
+
+  /** `true` if a value has been written to the response */
+  bool writing_;
+
+  /** `true` if a request is being timed */
+  bool running_ = false;
+
+  /**
+   * Mark the start of a request.
+   */
+  void start() {
+    start_ = parsed_ = clock::now();
+    writing_ = false;
+    running_ = true;
+  }
+
+  /**
+   * Stop timing the current request without reporting its durations,
+   * for requests that end before they are evaluated.
+   */
+  void discard() { running_ = false; }
+
+  /**
+   * Return `true` if a request is being timed.
+   *
+   * @return `true` if started and neither stopped nor discarded
+   */
+  bool running() const { return running_; }
+
+  /**
+   * Mark that an argument has been read.
+   */
+  void read() {
+    if (!writing_)
+      parsed_ = clock::now();
+  }
+
+  /**
+   * Mark that a value has been written to the response.
+   */
+  void write() {
+    if (!writing_) {
+      evaluated_ = clock::now();
+      writing_ = true;
+    }
+  }
+
+  /**
+   * Mark the end of the request and write the nanoseconds spent in
+   * each phase into the specified array.
+   *
+   * @param[out] ns array of `NUM_PHASES` durations
+   */
+  void stop(std::uint64_t* ns) {
+    clock::time_point end = clock::now();
+    if (!writing_)
+      evaluated_ = end;
+    ns[PHASE_PARSE] = nanoseconds(start_, parsed_);
+    ns[PHASE_EVAL] = nanoseconds(parsed_, evaluated_);
+    ns[PHASE_SERIALIZE] = nanoseconds(evaluated_, end);
+    ns[PHASE_TOTAL] = nanoseconds(start_, end);
+    running_ = false;
+  }
+
+  /**
+   * Return the number of nanoseconds between the specified times.
+   *
+   * @param from earlier time
+   * @param to later time
+   * @return nanoseconds between the times
+   */
+  static std::uint64_t nanoseconds(clock::time_point from,
+                                   clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from)
+        .count();
+  }
+};
+
+/**
+ * Latency histograms for each phase of one instruction.
+ */
+struct instruction_stats {
+  /** Latencies of each phase, indexed by `request_phase` */
+  latency_histogram phases_[NUM_PHASES];
+
+  /**
+   * Record the specified durations of each phase.
+   *
+   * @param ns array of `NUM_PHASES` durations in nanoseconds
+   */
+  void record(const std::uint64_t* ns) {
+    for (int p = 0; p < NUM_PHASES; ++p)
+      phases_[p].record(ns[p]);
+  }
+
+  /**
+   * Return the number of requests recorded.
+   *
+   * @return number of requests
+   */
+  std::uint64_t count() const { return phases_[PHASE_TOTAL].count(); }
+};
+
+/**
+ * Request reader that marks the timer each time an argument is read
+ * from the request it wraps.
+ */
+struct timed_request_reader : public request_reader {
+  request_reader& req_;
+  request_timer& timer_;
+
+  /**
+   * Construct a reader wrapping the specified reader and marking the
+   * specified timer.
+   *
+   * @param req request reader
+   * @param timer timer to mark
+   */
+  timed_request_reader(request_reader& req, request_timer& timer)
+      : req_(req), timer_(timer) { }
+
+  bool read_bool() {
+    bool b = req_.read_bool();
+    timer_.read();
+    return b;
+  }
+
+  int read_option(int bits) {
+    int n = req_.read_option(bits);
+    timer_.read();
+    return n;
+  }
+
+  std::int64_t read_int() {
+    std::int64_t n = req_.read_int();
+    timer_.read();
+    return n;
+  }
+
+  void read_doubles(double* x, std::size_t n) {
+    req_.read_doubles(x, n);
+    timer_.read();
+  }
+
+  std::size_t max_doubles() const {
+    return req_.max_doubles();
+  }
+
+  std::string read_rest() {
+    std::string rest = req_.read_rest();
+    timer_.read();
+    return rest;
+  }
+
+  bool at_end() {
+    return req_.at_end();
+  }
+};
+
+/**
+ * Response writer that marks the timer when the first value is
+ * written to the response it wraps.
+ */
+struct timed_response_writer : public response_writer {
+  response_writer& res_;
+  request_timer& timer_;
+
+  /**
+   * Construct a writer wrapping the specified writer and marking the
+   * specified timer.
+   *
+   * @param res response writer
+   * @param timer timer to mark
+   */
+  timed_response_writer(response_writer& res, request_timer& timer)
+      : res_(res), timer_(timer) { }
+
+  void write_int(std::int64_t n) {
+    timer_.write();
+    res_.write_int(n);
+  }
+
+  void write_doubles(const double* x, std::size_t n) {
+    timer_.write();
+    res_.write_doubles(x, n);
+  }
+
+  void write_strings(const std::vector<std::string>& xs) {
+    timer_.write();
+    res_.write_strings(xs);
+  }
+
+  void write_message(const std::string& msg) {
+    timer_.write();
+    res_.write_message(msg);
+  }
+
+  void end_part() {
+    timer_.write();
+    res_.end_part();
+  }
+
+  void end() {
+    timer_.write();
+    res_.end();
+  }
+
+  void end_error(response_status status, const std::string& msg) {
+    timer_.write();
+    res_.end_error(status, msg);
+  }
+};
+
+#endif
@@ -0,0 +1,63 @@
+"""Fixtures for tests of the Stan model server through the Python client.
+
+The tests run the servers for `stan/bernoulli/bernoulli` and
+`stan/multi/multi`, which `make test` builds first.  Other executables
+can be given with the environment variables `BERNOULLI_SERVER` and
+`MULTI_SERVER`.  Tests that need a server built with
+`STAN_THREADS=true` or `HESSIAN_AD=true` only run if the environment
+variable of the same name is `true`, as `make test` sets it from the
+make variable.
+"""
+
+import os
+import sys
+
+import pytest
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, ROOT)
+
+import StanModelClient as smc  # noqa: E402
+
+BERNOULLI_DATA = os.path.join(ROOT, "stan", "bernoulli", "bernoulli.data.json")
+MULTI_DATA = os.path.join(ROOT, "stan", "multi", "multi.data.json")
+
+
+def server_path(variable: str, default: str) -> str:
+    """Return the server executable named by the environment variable
+    or the default path relative to the repository, skipping the test
+    if it has not been built."""
+    path = os.environ.get(variable, os.path.join(ROOT, default))
+    if not os.access(path, os.X_OK):
+        pytest.skip(f"{path} not built; run make test")
+    return path
+
+
+def enabled(variable: str) -> bool:
+    """Return `True` if the build option is enabled for the tests."""
+    return os.environ.get(variable, "false") == "true"
+
+
+@pytest.fixture(params=["text", "binary"])
+def protocol(request):
+    return request.param
+
+
+@pytest.fixture
+def bernoulli_server():
+    return server_path("BERNOULLI_SERVER", os.path.join("stan", "bernoulli", "bernoulli"))
+
+
+@pytest.fixture
+def multi_server():
+    return server_path("MULTI_SERVER", os.path.join("stan", "multi", "multi"))
+
+
+@pytest.fixture
+def bernoulli(bernoulli_server, protocol):
+    return smc.StanClient(bernoulli_server, data=BERNOULLI_DATA, protocol=protocol)
+
+
+@pytest.fixture
+def multi(multi_server, protocol):
+    return smc.StanClient(multi_server, data=MULTI_DATA, protocol=protocol)
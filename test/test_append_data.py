@@ -0,0 +1,36 @@
+"""Tests of extending the data with the append_data instruction."""
+
+import json
+
+import pytest
+
+import StanModelClient as smc
+from conftest import BERNOULLI_DATA
+
+POINTS = [[-1.5], [0.0], [0.3], [2.2]]
+
+
+def test_append_data_matches_full_data(bernoulli_server, protocol, tmp_path):
+    with open(BERNOULLI_DATA) as f:
+        data = json.load(f)
+    rows = {"N": data["N"] + 3, "y": [1, 1, 0]}
+    full = dict(N=rows["N"], y=data["y"] + rows["y"])
+    path = tmp_path / "full.data.json"
+    path.write_text(json.dumps(full))
+
+    appended = smc.StanClient(bernoulli_server, data=BERNOULLI_DATA, protocol=protocol)
+    assert appended.append_data(rows) == 1
+    expected = smc.StanClient(bernoulli_server, data=str(path), protocol=protocol)
+    for x in POINTS:
+        assert appended.log_density(x) == expected.log_density(x)
+
+
+def test_append_data_errors_leave_instance_unchanged(bernoulli):
+    before = bernoulli.log_density([0.3])
+    with pytest.raises(RuntimeError, match="does not exist"):
+        bernoulli.append_data({"z": [1]})
+    with pytest.raises(RuntimeError, match="non-int"):
+        bernoulli.append_data({"y": [0.5]})
+    with pytest.raises(RuntimeError):
+        bernoulli.append_data({"y": [1]})  # N no longer matches y
+    assert bernoulli.log_density([0.3]) == before
@@ -0,0 +1,18 @@
+"""Tests of swapping in new data with the load_data instruction."""
+
+import json
+
+import pytest
+
+
+def test_load_data(multi, tmp_path):
+    assert multi.load_data({"M": 4, "N": 3, "P": 10}) == 4
+    assert multi.dims() == 4
+    assert multi.param_num(tp=False, gq=False) == 4
+    path = tmp_path / "multi.data.json"
+    path.write_text(json.dumps({"M": 3, "N": 1, "P": 2}))
+    assert multi.load_data(str(path)) == 3
+    assert multi.param_num() == 3 + 1 + 2
+    with pytest.raises(RuntimeError):
+        multi.load_data(str(tmp_path / "missing.json"))
+    assert multi.dims() == 3  # the instance is unchanged
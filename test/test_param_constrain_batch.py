@@ -0,0 +1,45 @@
+"""Tests of the batched param_constrain instruction."""
+
+import struct
+
+import numpy as np
+import pytest
+
+import StanModelClient as smc
+from conftest import MULTI_DATA, enabled
+
+
+def test_param_constrain_batch_matches_param_constrain(multi):
+    xs = [[0.1, 0.2], [-0.5, 1.5], [2.0, -3.0]]
+    zs = multi.param_constrain_batch(xs, first_draw=7)
+    assert len(zs) == len(xs)
+    for n, x in enumerate(xs):
+        np.testing.assert_allclose(zs[n], multi.param_constrain(x, draw=7 + n))
+    np.testing.assert_allclose(
+        multi.param_constrain_batch(xs, gq=False),
+        [multi.param_constrain(x, gq=False) for x in xs],
+    )
+
+
+@pytest.mark.skipif(not enabled("STAN_THREADS"), reason="requires STAN_THREADS=true")
+def test_param_constrain_batch_parallel_matches_sequential(multi_server, protocol):
+    sequential = smc.StanClient(multi_server, data=MULTI_DATA, protocol=protocol)
+    parallel = smc.StanClient(
+        multi_server, data=MULTI_DATA, protocol=protocol, threads=4
+    )
+    xs = [[0.01 * n, -0.02 * n] for n in range(100)]
+    np.testing.assert_array_equal(
+        parallel.param_constrain_batch(xs, first_draw=3),
+        sequential.param_constrain_batch(xs, first_draw=3),
+    )
+
+
+def test_param_constrain_batch_rejects_bad_counts(multi):
+    with pytest.raises(RuntimeError, match="exceeds request size"):
+        if multi.binary:
+            multi._binary_request(
+                "param_constrain_batch", (True, True), struct.pack("<qd", 1 << 40, 0.5)
+            )
+        else:
+            multi._request("param_constrain_batch 1 1 1099511627776 0.5")
+    assert multi.dims() == 2  # the session continues
@@ -0,0 +1,93 @@
+"""Tests that the binary protocol gives the same results as the text protocol."""
+
+import struct
+import subprocess
+
+import numpy as np
+import pytest
+
+import StanModelClient as smc
+from conftest import BERNOULLI_DATA, MULTI_DATA, enabled
+
+# text responses carry 15 significant digits
+RTOL = 1e-13
+
+POINTS = [[-1.5], [0.0], [0.3], [2.2]]
+
+
+def text_and_binary(server, data):
+    return (
+        smc.StanClient(server, data=data, protocol="text"),
+        smc.StanClient(server, data=data, protocol="binary"),
+    )
+
+
+@pytest.mark.parametrize("propto", [True, False])
+@pytest.mark.parametrize("jacobian", [True, False])
+def test_log_density_binary_matches_text(bernoulli_server, propto, jacobian):
+    text, binary = text_and_binary(bernoulli_server, BERNOULLI_DATA)
+    for x in POINTS:
+        np.testing.assert_allclose(
+            binary.log_density(x, propto, jacobian),
+            text.log_density(x, propto, jacobian),
+            rtol=RTOL,
+        )
+
+
+def test_gradient_binary_matches_text(bernoulli_server):
+    text, binary = text_and_binary(bernoulli_server, BERNOULLI_DATA)
+    for x in POINTS:
+        lp_text, grad_text = text.log_density_gradient(x)
+        lp_binary, grad_binary = binary.log_density_gradient(x)
+        np.testing.assert_allclose(lp_binary, lp_text, rtol=RTOL)
+        np.testing.assert_allclose(grad_binary, grad_text, rtol=RTOL)
+
+
+@pytest.mark.parametrize(
+    "hess_method",
+    ["fd", pytest.param("ad", marks=pytest.mark.skipif(
+        not enabled("HESSIAN_AD"), reason="requires HESSIAN_AD=true"))],
+)
+def test_hessian_binary_matches_text(multi_server, hess_method):
+    text, binary = text_and_binary(multi_server, MULTI_DATA)
+    x = [0.4, -1.1]
+    lp_text, grad_text, hess_text = text.log_density_hessian(x, hess_method=hess_method)
+    lp_binary, grad_binary, hess_binary = binary.log_density_hessian(
+        x, hess_method=hess_method
+    )
+    np.testing.assert_allclose(lp_binary, lp_text, rtol=RTOL)
+    np.testing.assert_allclose(grad_binary, grad_text, rtol=RTOL)
+    np.testing.assert_allclose(hess_binary, hess_text, rtol=RTOL, atol=1e-12)
+    np.testing.assert_allclose(hess_binary, [[-1, 0], [0, -1]], atol=1e-5)
+
+
+def test_errors_are_raised_and_session_continues(bernoulli):
+    with pytest.raises(RuntimeError, match="no model instance named nope"):
+        bernoulli.use("nope")
+    assert bernoulli.dims() == 1
+
+
+def test_oversized_binary_payload_is_rejected(bernoulli_server):
+    server = subprocess.Popen(
+        [bernoulli_server, "--data", BERNOULLI_DATA, "--protocol", "binary",
+         "--max-payload", "64"],
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+    )
+
+    def request(opcode, flags, payload):
+        header = struct.pack("<HHIQ", opcode, flags, 0, len(payload))
+        server.stdin.write(header + payload)
+        server.stdin.flush()
+        _, status, _, length = struct.unpack("<HHIQ", server.stdout.read(16))
+        return status, server.stdout.read(length)
+
+    try:
+        status, message = request(8, 0b001, bytes(100))  # log_density
+        assert status == 1
+        assert b"exceeds maximum of 64 bytes" in message
+        status, payload = request(8, 0b001, struct.pack("<d", 0.3))
+        assert status == 0 and len(payload) == 8  # the session continues
+        request(0, 0, b"")  # quit
+    finally:
+        server.kill()
+        server.wait()